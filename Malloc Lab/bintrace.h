@@ -0,0 +1,64 @@
+/*
+ * bintrace.h - The binary trace format read by mdriver and written by rep2bin
+ *
+ * A binary trace holds the same requests as a .rep file, packed so that
+ * mdriver can mmap it and decode the requests while it replays them,
+ * without parsing anything when it starts. It consists of
+ *
+ *   the 8 bytes of BINTRACE_MAGIC
+ *   the four numbers of the header of a .rep file as varints: the suggested
+ *     heap size, the number of ids, the number of requests and the weight
+ *   every request as the varint (index << BT_TYPE_BITS) | type, followed by
+ *     the varint of the alignment if the request is a memalign or of the
+ *     number of blocks if it is a batch, and the varint of the size unless
+ *     the request is a free or a batch free
+ *
+ * A varint stores 7 bits of a number per byte, low bits first, and the
+ * high bit of a byte is set if more bytes follow.
+ */
+#ifndef __BINTRACE_H_
+#define __BINTRACE_H_
+
+#define BINTRACE_MAGIC "MMTRACE\001"
+#define BINTRACE_MAGIC_LEN 8
+
+/* The codes of the requests, which are the types of traceop_t in mdriver.c */
+enum { BT_ALLOC, BT_FREE, BT_REALLOC, BT_CALLOC, BT_MEMALIGN,
+       BT_ALLOC_BATCH, BT_FREE_BATCH };
+#define BT_TYPE_BITS 3
+#define BT_TYPE_MASK ((1 << BT_TYPE_BITS) - 1)
+
+/* the largest number of bytes of a varint */
+#define VARINT_MAX 10
+
+/*
+ * put_varint - Write v at p and return the byte after it
+ */
+static inline unsigned char *put_varint(unsigned char *p, unsigned long v)
+{
+    while (v >= 0x80) {
+	*p++ = (unsigned char)(v | 0x80);
+	v >>= 7;
+    }
+    *p++ = (unsigned char)v;
+    return p;
+}
+
+/*
+ * get_varint - Read a varint at p into *v and return the byte after it
+ */
+static inline const unsigned char *get_varint(const unsigned char *p,
+					       unsigned long *v)
+{
+    unsigned long x = 0;
+    int shift = 0;
+
+    while (*p & 0x80) {
+	x |= (unsigned long)(*p++ & 0x7f) << shift;
+	shift += 7;
+    }
+    *v = x | ((unsigned long)*p++ << shift);
+    return p;
+}
+
+#endif /* __BINTRACE_H_ */
@@ -53,14 +53,17 @@
 #define UTIL_WEIGHT .60
 
 /* 
- * Alignment requirement in bytes (either 4 or 8) 
+ * Alignment requirement in bytes, which is 16 like the malloc of x86-64
  */
-#define ALIGNMENT 8  
+#define ALIGNMENT 16
 
 /* 
- * Maximum heap size in bytes 
+ * Maximum heap size in bytes, with room for "mdriver -j" to replay
+ * a trace from several threads at the same time and for the large
+ * traces made by tracegen. Only the pages that are touched take memory.
+ * Since it is more than an int can count, mem_sbrk takes an intptr_t.
  */
-#define MAX_HEAP (20*(1<<20))  /* 20 MB */
+#define MAX_HEAP (4UL << 30)  /* 4 GB, as much as mm.c can address */
 
 /*****************************************************************************
  * Set exactly one of these USE_xxx constants to "1" to select a timing method
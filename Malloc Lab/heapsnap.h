@@ -0,0 +1,44 @@
+/*
+ * heapsnap.h - The heap snapshots written by mm_dump_snapshot and read
+ *     by snapreport
+ *
+ * A snapshot lays out every block of the heap of mm.c at one moment,
+ * together with the payloads the sampling profiler of mm.c recorded
+ * which were still allocated. It is made of the varints of bintrace.h:
+ *
+ *   the 8 bytes of HEAPSNAP_MAGIC
+ *   the header as four varints: the bytes from mem_heap_lo to the brk,
+ *     the sample period (0 if the profiler was off), the site last set
+ *     with mm_set_site, and the number of arenas
+ *   records, each of which starts with the varint of its tag:
+ *     SNAP_SEGMENT  the offset of the first block of a segment from the
+ *                   start of the heap, then every block of it in order as
+ *                   the varint size | kind, ended by a 0 (the epilogue).
+ *                   A slab page is followed by the varints of its slot
+ *                   size, its number of slots and the slots in use.
+ *     SNAP_MAPPED   the length of the mapping of a block outside the heap
+ *     SNAP_SAMPLE   a sampled payload: its offset from the start of the
+ *                   heap (0 if it has a mapping of its own), the size of
+ *                   its block, slot or mapping, the bytes requested, its
+ *                   site and the number of sampled bytes in it
+ *     SNAP_END      the end of the snapshot
+ *
+ * Sizes of blocks are multiples of 16, which leaves room for the kind.
+ * Blocks cached by the threads, or waiting to be coalesced, are allocated.
+ */
+#ifndef __HEAPSNAP_H_
+#define __HEAPSNAP_H_
+
+#include "bintrace.h"
+
+#define HEAPSNAP_MAGIC "MMSNAP\0\001"
+#define HEAPSNAP_MAGIC_LEN 8
+
+/* The tags of the records */
+enum { SNAP_SEGMENT, SNAP_MAPPED, SNAP_SAMPLE, SNAP_END };
+
+/* The kinds of the blocks of a segment */
+enum { SNAP_ALLOC, SNAP_FREE, SNAP_SLAB };
+#define SNAP_KIND_MASK 15
+
+#endif /* __HEAPSNAP_H_ */
@@ -15,11 +15,17 @@
 #include <assert.h>
 #include <float.h>
 #include <time.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "mm.h"
 #include "memlib.h"
 #include "fsecs.h"
+#include "perfctr.h"
 #include "config.h"
+#include "bintrace.h"
 
 /**********************
  * Constants and macros
@@ -29,26 +35,43 @@
 #define MAXLINE     1024 /* max string size */
 #define HDRLINES       4 /* number of header lines in a trace file */
 #define LINENUM(i) (i+5) /* cnvt trace request nums to linenums (origin 1) */
+#define MAX_THREADS   64 /* max number of threads replaying a trace (-j) */
+#define CHECK_EVERY 1000 /* requests between walks of the whole heap by mm_check */
+
+/* Returns true if the free of id index is handed to another thread, 
+   which is the case for about cross percent of the ids (-x) */
+#define CROSS_FREE(index, cross) \
+    ((unsigned)(index) * 2654435761u % 100 < (unsigned)(cross))
 
 /* Returns true if p is ALIGNMENT-byte aligned */
-#define IS_ALIGNED(p)  ((((unsigned int)(p)) % ALIGNMENT) == 0)
+#define IS_ALIGNED(p)  ((((size_t)(p)) % ALIGNMENT) == 0)
 
 /****************************** 
  * The key compound data types 
  *****************************/
 
-/* Records the extent of each block's payload */
+/* 
+ * Records the extent of each block's payload. The ranges of a trace
+ * form a treap ordered by lo, where every range has a random priority
+ * no less than those of its children.
+ */
 typedef struct range_t {
     char *lo;              /* low payload address */
     char *hi;              /* high payload address */
-    struct range_t *next;  /* next list element */
+    struct range_t *left;  /* ranges below this one (next free record in the pool) */
+    struct range_t *right; /* ranges above this one */
+    unsigned int priority; /* random priority */
 } range_t;
 
 /* Characterizes a single trace operation (allocator request) */
 typedef struct {
-    enum {ALLOC, FREE, REALLOC} type; /* type of request */
+    enum {ALLOC = BT_ALLOC, FREE = BT_FREE, REALLOC = BT_REALLOC,
+	  CALLOC = BT_CALLOC, MEMALIGN = BT_MEMALIGN,
+	  ALLOC_BATCH = BT_ALLOC_BATCH, FREE_BATCH = BT_FREE_BATCH} type; /* type of request */
     int index;                        /* index for free() to use later */
     int size;                         /* byte size of alloc/realloc request */
+    int align;                        /* alignment of a memalign request */
+    int count;                        /* number of blocks of a batch, whose ids start at index */
 } traceop_t;
 
 /* Holds the information for one trace file*/
@@ -57,11 +80,24 @@ typedef struct {
     int num_ids;         /* number of alloc/realloc ids */
     int num_ops;         /* number of distinct requests */
     int weight;          /* weight for this trace (unused) */
-    traceop_t *ops;      /* array of requests */
+    traceop_t *ops;      /* array of requests, NULL for a binary trace... */
+    unsigned char *map;  /* ... whose file is mapped here instead */
+    size_t map_len;      /* length of the mapping */
+    const unsigned char *code; /* first request in the mapping */
     char **blocks;       /* array of ptrs returned by malloc/realloc... */
     size_t *block_sizes; /* ... and a corresponding array of payload sizes */
 } trace_t;
 
+/* 
+ * Reads the requests of a trace in order, from the ops array of a text 
+ * trace or by decoding the mapping of a binary trace (see bintrace.h)
+ */
+typedef struct {
+    trace_t *trace;
+    int i;                   /* number of requests read */
+    const unsigned char *p;  /* next request of a binary trace */
+} opreader_t;
+
 /* 
  * Holds the params to the xxx_speed functions, which are timed by fcyc. 
  * This struct is necessary because fcyc accepts only a pointer array
@@ -72,6 +108,82 @@ typedef struct {
     range_t *ranges;
 } speed_t;
 
+/* The functions called by a replay, those of mm.c or those of libc */
+typedef struct {
+    void *(*malloc_fn)(size_t size);
+    void (*free_fn)(void *ptr);
+    void *(*realloc_fn)(void *ptr, size_t size);
+    void *(*calloc_fn)(size_t nmemb, size_t size);
+    void *(*memalign_fn)(size_t align, size_t size);
+    size_t (*malloc_batch_fn)(size_t size, size_t n, void **out);
+    void (*free_batch_fn)(void **ptrs, size_t n);
+} funcs_t;
+
+/* 
+ * A block handed to another thread to be freed by it. Every thread 
+ * has one for each id of the trace, since an id is freed at most once.
+ */
+typedef struct handoff_t {
+    char *block;
+    struct handoff_t *next;
+} handoff_t;
+
+struct threads_t;
+
+/* Holds the params to each thread started by eval_threads */
+typedef struct {
+    trace_t *trace;  
+    struct threads_t *params; /* the params shared by all threads */
+    int id;          /* the index of this thread */
+    char **blocks;   /* this thread's own array of ptrs returned by mm */
+    handoff_t *handoffs; /* this thread's handoffs, one for each id */
+    handoff_t *inbox;    /* blocks handed to this thread by the previous one */
+    int failed;      /* did mm_malloc or mm_realloc fail in this thread? */
+} replay_t;
+
+/* Holds the params to eval_threads, which is timed by fsecs */
+typedef struct threads_t {
+    int nthreads;                 /* number of threads replaying the trace */
+    int cross;                    /* percentage of frees made by the next thread */
+    const funcs_t *funcs;         /* the package being measured */
+    pthread_barrier_t done;       /* passed by the threads once they are done */
+    replay_t replay[MAX_THREADS]; /* params to each thread */
+} threads_t;
+
+/* The number of types of requests, which have a histogram each */
+#define NUM_OP_TYPES 7
+
+/* A histogram of latencies in cycles (see eval_mm_latency) */
+#define HIST_SUB_BITS 5
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+typedef struct {
+    unsigned long long count;               /* number of values */
+    unsigned long long max;                 /* largest value */
+    unsigned long long counts[HIST_BUCKETS];/* number of values in each bucket */
+} hist_t;
+
+/* The shape of the free blocks of the heap over the course of a trace 
+   (-F), sampled from mm_stats() FRAG_SAMPLES times while it is replayed */
+#define FRAG_SAMPLES 64
+typedef struct {
+    int n;                      /* number of samples taken */
+    double free[FRAG_SAMPLES];  /* free bytes as a fraction of the heap */
+    double ext[FRAG_SAMPLES];   /* external fragmentation of those bytes */
+    size_t max_blocks;          /* most free blocks at any sample */
+    size_t max_largest;         /* largest free block at any sample */
+    double steps;               /* free blocks looked at per search */
+} frag_t;
+
+/* A snapshot of the heap of mm.c for snapreport (-d), which is taken 
+   after the request at which the heap was largest, with the sampling 
+   profiler of mm.c recording the index of the request of each sample */
+typedef struct {
+    int peak_op;                /* request after which the heap was largest */
+    int dump_op;                /* request after which to take the snapshot, or -1 */
+    char path[MAXLINE];         /* file the snapshot is written to */
+} snap_t;
+
 /* Summarizes the important stats for some malloc function on some trace */
 typedef struct {
     /* defined for both libc malloc and student malloc package (mm.c) */
@@ -81,6 +193,10 @@ typedef struct {
 
     /* defined only for the student malloc package */
     double util;     /* space utilization for this trace (always 0 for libc) */
+    double ovhd;     /* avg overhead bytes per allocated block at peak (0 for libc) */
+    double hit;      /* fraction of small mallocs served by the thread cache (0 for libc) */
+    double copied;   /* payload bytes copied by mm_realloc (0 for libc) */
+    double rss;      /* resident bytes of the heap at the end of the trace (0 for libc) */
 
     /* Note: secs and util are only defined if valid is true */
 } stats_t; 
@@ -89,6 +205,7 @@ typedef struct {
  * Global variables
  *******************/
 int verbose = 0;        /* global flag for verbose output */
+static int check_full = 0; /* walk the whole heap after every request (-C) */
 static int errors = 0;  /* number of errs found when running student malloc */
 char msg[MAXLINE];      /* for whenever we need to compose an error message */
 
@@ -100,12 +217,25 @@ static char *default_tracefiles[] = {
     DEFAULT_TRACEFILES, NULL
 };
 
+/* The malloc packages measured by the replays. The batch requests of 
+   mm go through mm_malloc_batch and mm_free_batch, unless -U has them 
+   make one call per block like those of libc. */
+static void *libc_memalign(size_t align, size_t size);
+static size_t libc_malloc_batch(size_t size, size_t n, void **out);
+static void libc_free_batch(void **ptrs, size_t n);
+static size_t mm_malloc_each(size_t size, size_t n, void **out);
+static void mm_free_each(void **ptrs, size_t n);
+static funcs_t mm_funcs = {mm_malloc, mm_free, mm_realloc, mm_calloc, mm_memalign,
+			   mm_malloc_batch, mm_free_batch};
+static const funcs_t libc_funcs = {malloc, free, realloc, calloc, libc_memalign,
+				   libc_malloc_batch, libc_free_batch};
+
 
 /********************* 
  * Function prototypes 
  *********************/
 
-/* these functions manipulate range lists */
+/* these functions manipulate range trees */
 static int add_range(range_t **ranges, char *lo, int size, 
 		     int tracenum, int opnum);
 static void remove_range(range_t **ranges, char *lo);
@@ -113,7 +243,11 @@ static void clear_ranges(range_t **ranges);
 
 /* These functions read, allocate, and free storage for traces */
 static trace_t *read_trace(char *tracedir, char *filename);
+static int map_trace(trace_t *trace, FILE *tracefile);
 static void free_trace(trace_t *trace);
+static inline void start_ops(opreader_t *r, trace_t *trace);
+static inline int next_op(opreader_t *r, traceop_t *op);
+static inline void *alloc_op(const funcs_t *funcs, traceop_t *op);
 
 /* Routines for evaluating the correctness and speed of libc malloc */
 static int eval_libc_valid(trace_t *trace, int tracenum);
@@ -122,11 +256,50 @@ static void eval_libc_speed(void *ptr);
 /* Routines for evaluating correctnes, space utilization, and speed 
    of the student's malloc package in mm.c */
 static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges);
-static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges);
+static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges,
+			   double *ovhd, double *hit, double *copied, double *rss,
+			   frag_t *frag, snap_t *snap);
 static void eval_mm_speed(void *ptr);
 
+/* Routines for plotting the fragmentation of the heap of mm.c */
+static void frag_sample(frag_t *frag);
+static void print_frag(int n, frag_t *frags);
+
+/* Routines for writing snapshots of the heap of mm.c */
+static void take_snapshot(trace_t *trace, int tracenum, range_t **ranges,
+			  snap_t *snap, char *prefix, size_t period);
+static void write_snapshot(snap_t *snap);
+
+/* Routines for evaluating the throughput of mm.c with several threads */
+static void free_inbox(replay_t *replay);
+static void hand_off(replay_t *replay, int index, char *block);
+static void *replay_trace(void *ptr);
+static void eval_threads(void *ptr);
+static void print_scaling(double kops, double kops1, int nthreads);
+static void eval_mm_scaling(int n, char **tracefiles, int max_threads, 
+			    int cross);
+
+/* Routines for measuring the latency of each request of mm.c */
+static inline unsigned long long read_tsc(void);
+static inline int hist_index(unsigned long long v);
+static unsigned long long hist_value(int i);
+static inline void hist_add(hist_t *h, unsigned long long v);
+static void hist_merge(hist_t *a, hist_t *b);
+static unsigned long long hist_percentile(hist_t *h, double q);
+static unsigned long long tsc_overhead(void);
+static void eval_mm_latency(trace_t *trace, hist_t *hists);
+static void print_latency(int n, hist_t (*hists)[NUM_OP_TYPES]);
+
+/* Routine for printing the hardware events counted for each trace */
+static void print_perf(int n, double (*perf)[PERF_EVENTS], stats_t *stats);
+
+/* These functions save and load the per-trace results of a run */
+static void save_results(char *filename, int n, char **tracefiles, 
+			 stats_t *stats);
+static stats_t *load_results(char *filename, int n, char **tracefiles);
+
 /* Various helper routines */
-static void printresults(int n, stats_t *stats);
+static void printresults(int n, stats_t *stats, stats_t *base);
 static void usage(void);
 static void unix_error(char *msg);
 static void malloc_error(int tracenum, int opnum, char *msg);
@@ -145,11 +318,25 @@ int main(int argc, char **argv)
     range_t *ranges = NULL;    /* keeps track of block extents for one trace */
     stats_t *libc_stats = NULL;/* libc stats for each trace */
     stats_t *mm_stats = NULL;  /* mm (i.e. student) stats for each trace */
+    stats_t *base_stats = NULL;/* baseline stats for each trace (set by -b) */
+    char *save_file = NULL;    /* file to save the mm stats to (set by -s) */
+    char *base_file = NULL;    /* file to load the baseline stats from (-b) */
+    int max_threads = 0;       /* replay traces with up to this many threads (-j) */
+    int cross = 0;             /* percentage of frees made by another thread (-x) */
+    hist_t (*latency)[NUM_OP_TYPES] = NULL; /* latencies for each trace */
+    frag_t *frags = NULL;      /* fragmentation over each trace (-F) */
+    snap_t snap;               /* the snapshot of the heap of a trace (-d) */
+    char *snap_prefix = NULL;  /* snapshots go to <prefix><trace>.snap (-d) */
+    size_t sample_period = 4096; /* bytes between samples in snapshots (-p) */
+    double (*perf)[PERF_EVENTS] = NULL; /* hardware events for each trace (-P) */
     speed_t speed_params;      /* input parameters to the xx_speed routines */ 
 
     int team_check = 1;  /* If set, check team structure (reset by -a) */
     int run_libc = 0;    /* If set, run libc malloc (set by -l) */
     int autograder = 0;  /* If set, emit summary info for autograder (-g) */
+    int run_latency = 0; /* If set, measure the latency of each request (-L) */
+    int run_frag = 0;    /* If set, plot the fragmentation over each trace (-F) */
+    int run_perf = 0;    /* If set, count hardware events for each trace (-P) */
 
     /* temporaries used to compute the performance index */
     double secs, ops, util, avg_mm_util, avg_mm_throughput, p1, p2, perfindex;
@@ -158,7 +345,7 @@ int main(int argc, char **argv)
     /* 
      * Read and interpret the command line arguments 
      */
-    while ((c = getopt(argc, argv, "f:t:hvVgal")) != EOF) {
+    while ((c = getopt(argc, argv, "f:t:s:b:j:x:d:p:hvVgalLFCPU")) != EOF) {
         switch (c) {
 	case 'g': /* Generate summary info for the autograder */
 	    autograder = 1;
@@ -178,12 +365,58 @@ int main(int argc, char **argv)
 	    if (tracedir[strlen(tracedir)-1] != '/') 
 		strcat(tracedir, "/"); /* path always ends with "/" */
 	    break;
+	case 's': /* Save the per-trace results of mm malloc to a file */
+	    save_file = optarg;
+	    break;
+	case 'b': /* Compare the results of mm malloc against a saved run */
+	    base_file = optarg;
+	    break;
+	case 'j': /* Replay each trace with up to this many threads */
+	    max_threads = atoi(optarg);
+	    if (max_threads < 1 || max_threads > MAX_THREADS) {
+		printf("ERROR: -j expects between 1 and %d threads\n", MAX_THREADS);
+		exit(1);
+	    }
+	    break;
+	case 'x': /* With -j, have another thread free this percentage of blocks */
+	    cross = atoi(optarg);
+	    if (cross < 0 || cross > 100) {
+		printf("ERROR: -x expects a percentage between 0 and 100\n");
+		exit(1);
+	    }
+	    break;
         case 'a': /* Don't check team structure */
             team_check = 0;
             break;
         case 'l': /* Run libc malloc */
             run_libc = 1;
             break;
+	case 'L': /* Measure the latency of each request */
+	    run_latency = 1;
+	    break;
+	case 'F': /* Plot the fragmentation over each trace */
+	    run_frag = 1;
+	    break;
+	case 'd': /* Write a snapshot of the heap at its peak in each trace */
+	    snap_prefix = optarg;
+	    break;
+	case 'p': /* With -d, sample a payload every this many bytes */
+	    sample_period = strtoul(optarg, NULL, 10);
+	    if (sample_period == 0) {
+		printf("ERROR: -p expects a positive number of bytes\n");
+		exit(1);
+	    }
+	    break;
+	case 'C': /* Walk the whole heap with mm_check after every request */
+	    check_full = 1;
+	    break;
+	case 'P': /* Count hardware events for each trace */
+	    run_perf = 1;
+	    break;
+	case 'U': /* Make the batch requests of mm one block at a time */
+	    mm_funcs.malloc_batch_fn = mm_malloc_each;
+	    mm_funcs.free_batch_fn = mm_free_each;
+	    break;
         case 'v': /* Print per-trace performance breakdown */
             verbose = 1;
             break;
@@ -269,7 +502,7 @@ int main(int argc, char **argv)
 	/* Display the libc results in a compact table */
 	if (verbose) {
 	    printf("\nResults for libc malloc:\n");
-	    printresults(num_tracefiles, libc_stats);
+	    printresults(num_tracefiles, libc_stats, NULL);
 	}
     }
 
@@ -284,6 +517,29 @@ int main(int argc, char **argv)
     if (mm_stats == NULL)
 	unix_error("mm_stats calloc in main failed");
     
+    /* Allocate the latency histograms, with a set per tracefile */
+    if (run_latency) {
+	latency = calloc(num_tracefiles, sizeof(*latency));
+	if (latency == NULL)
+	    unix_error("latency calloc in main failed");
+    }
+
+    /* Open the hardware counters, with a set of counts per tracefile */
+    if (run_perf) {
+	if (perf_init() == 0)
+	    printf("Hardware counters are not available, see "
+		   "/proc/sys/kernel/perf_event_paranoid\n");
+	else if ((perf = calloc(num_tracefiles, sizeof(*perf))) == NULL)
+	    unix_error("perf calloc in main failed");
+    }
+
+    /* Allocate the fragmentation samples, with a set per tracefile */
+    if (run_frag) {
+	frags = (frag_t *)calloc(num_tracefiles, sizeof(frag_t));
+	if (frags == NULL)
+	    unix_error("frags calloc in main failed");
+    }
+
     /* Initialize the simulated memory system in memlib.c */
     mem_init(); 
 
@@ -297,20 +553,67 @@ int main(int argc, char **argv)
 	if (mm_stats[i].valid) {
 	    if (verbose > 1)
 		printf("efficiency, ");
-	    mm_stats[i].util = eval_mm_util(trace, i, &ranges);
+	    snap.dump_op = -1;
+	    mm_stats[i].util = eval_mm_util(trace, i, &ranges, 
+					    &mm_stats[i].ovhd, &mm_stats[i].hit,
+					    &mm_stats[i].copied, &mm_stats[i].rss,
+					    (frags != NULL) ? &frags[i] : NULL,
+					    (snap_prefix != NULL) ? &snap : NULL);
+	    if (snap_prefix != NULL)
+		take_snapshot(trace, i, &ranges, &snap, snap_prefix, sample_period);
 	    speed_params.trace = trace;
 	    speed_params.ranges = ranges;
 	    if (verbose > 1)
 		printf("and performance.\n");
 	    mm_stats[i].secs = fsecs(eval_mm_speed, &speed_params);
+	    if (perf != NULL) {
+		perf_start();
+		eval_mm_speed(&speed_params);
+		perf_stop(perf[i]);
+	    }
+	    if (latency != NULL)
+		eval_mm_latency(trace, latency[i]);
 	}
 	free_trace(trace);
     }
 
+    /* Save the mm results for later comparisons and load the baseline */
+    if (save_file != NULL)
+	save_results(save_file, num_tracefiles, tracefiles, mm_stats);
+    if (base_file != NULL)
+	base_stats = load_results(base_file, num_tracefiles, tracefiles);
+
     /* Display the mm results in a compact table */
     if (verbose) {
 	printf("\nResults for mm malloc:\n");
-	printresults(num_tracefiles, mm_stats);
+	printresults(num_tracefiles, mm_stats, base_stats);
+	printf("\n");
+    }
+
+    /* Plot the fragmentation over each trace */
+    if (frags != NULL && errors == 0) {
+	print_frag(num_tracefiles, frags);
+	printf("\n");
+	free(frags);
+    }
+
+    /* Print the hardware events per request */
+    if (perf != NULL && errors == 0) {
+	print_perf(num_tracefiles, perf, mm_stats);
+	printf("\n");
+	free(perf);
+    }
+
+    /* Print the percentiles of the latencies */
+    if (latency != NULL && errors == 0) {
+	print_latency(num_tracefiles, latency);
+	printf("\n");
+	free(latency);
+    }
+
+    /* Measure how the throughput scales with the number of threads */
+    if (max_threads > 0 && errors == 0) {
+	eval_mm_scaling(num_tracefiles, tracefiles, max_threads, cross);
 	printf("\n");
     }
 
@@ -367,22 +670,107 @@ int main(int argc, char **argv)
 
 
 /*****************************************************************
- * The following routines manipulate the range list, which keeps 
+ * The following routines manipulate the range tree, which keeps 
  * track of the extent of every allocated block payload. We use the 
- * range list to detect any overlapping allocated blocks.
+ * range tree to detect any overlapping allocated blocks. Since the
+ * payloads in the tree never overlap, a new payload overlaps one of
+ * them if and only if it overlaps its neighbours in address order,
+ * so every check and update takes O(log n) expected time.
  ****************************************************************/
 
+/* Range records are carved out of blocks of RANGE_POOL records and
+   recycled through range_pool, instead of being malloc'ed one by one */
+#define RANGE_POOL 4096
+static range_t *range_pool = NULL;
+
+/*
+ * new_range - Take a range record from the pool and give it a random priority
+ */
+static range_t *new_range(char *lo, char *hi)
+{
+    static unsigned int seed = 2463534242u;
+    range_t *p;
+    int i;
+
+    if (range_pool == NULL) {
+	if ((p = (range_t *)malloc(RANGE_POOL * sizeof(range_t))) == NULL)
+	    unix_error("malloc error in new_range");
+	for (i = 0; i < RANGE_POOL; i++) {
+	    p[i].left = range_pool;
+	    range_pool = &p[i];
+	}
+    }
+    p = range_pool;
+    range_pool = p->left;
+
+    /* xorshift32 */
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+
+    p->lo = lo;
+    p->hi = hi;
+    p->left = p->right = NULL;
+    p->priority = seed;
+    return p;
+}
+
+/*
+ * split_ranges - Split the tree t into the ranges below lo, which 
+ *     go to *l, and the others, which go to *r
+ */
+static void split_ranges(range_t *t, char *lo, range_t **l, range_t **r)
+{
+    while (t != NULL) {
+	if (t->lo < lo) {
+	    *l = t;
+	    l = &t->right;
+	    t = t->right;
+	} else {
+	    *r = t;
+	    r = &t->left;
+	    t = t->left;
+	}
+    }
+    *l = *r = NULL;
+}
+
+/*
+ * merge_ranges - Merge the trees l and r, where every range of l 
+ *     is below every range of r
+ */
+static range_t *merge_ranges(range_t *l, range_t *r)
+{
+    range_t *t;
+    range_t **link = &t;
+
+    while (l != NULL && r != NULL) {
+	if (l->priority > r->priority) {
+	    *link = l;
+	    link = &l->right;
+	    l = l->right;
+	} else {
+	    *link = r;
+	    link = &r->left;
+	    r = r->left;
+	}
+    }
+    *link = (l != NULL) ? l : r;
+    return t;
+}
+
 /*
  * add_range - As directed by request opnum in trace tracenum,
  *     we've just called the student's mm_malloc to allocate a block of 
  *     size bytes at addr lo. After checking the block for correctness,
- *     we create a range struct for this block and add it to the range list. 
+ *     we create a range struct for this block and add it to the range tree. 
  */
 static int add_range(range_t **ranges, char *lo, int size, 
 		     int tracenum, int opnum)
 {
     char *hi = lo + size - 1;
-    range_t *p;
+    range_t *p, *below = NULL, *above = NULL;
+    range_t **link;
     char msg[MAXLINE];
 
     assert(size > 0);
@@ -395,36 +783,51 @@ static int add_range(range_t **ranges, char *lo, int size,
         return 0;
     }
 
-    /* The payload must lie within the extent of the heap */
-    if ((lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) || 
-	(hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi())) {
+    /* The payload must lie within the extent of the heap, or within 
+       a mapping the package got from mem_map */
+    if (!mem_in_heap(lo, hi)) {
 	sprintf(msg, "Payload (%p:%p) lies outside heap (%p:%p)",
 		lo, hi, mem_heap_lo(), mem_heap_hi());
 	malloc_error(tracenum, opnum, msg);
         return 0;
     }
 
-    /* The payload must not overlap any other payloads */
-    for (p = *ranges;  p != NULL;  p = p->next) {
-        if ((lo >= p->lo && lo <= p-> hi) ||
-            (hi >= p->lo && hi <= p->hi)) {
-	    sprintf(msg, "Payload (%p:%p) overlaps another payload (%p:%p)\n",
-		    lo, hi, p->lo, p->hi);
-	    malloc_error(tracenum, opnum, msg);
-	    return 0;
-        }
+    /* The payload must not overlap any other payloads, so it must end 
+       before the first payload above it and start after the last one 
+       at or below it */
+    for (p = *ranges;  p != NULL; ) {
+	if (lo < p->lo) {
+	    above = p;
+	    p = p->left;
+	} else {
+	    below = p;
+	    p = p->right;
+	}
+    }
+    p = NULL;
+    if (below != NULL && lo <= below->hi)
+	p = below;
+    else if (above != NULL && hi >= above->lo)
+	p = above;
+    if (p != NULL) {
+	sprintf(msg, "Payload (%p:%p) overlaps another payload (%p:%p)\n",
+		lo, hi, p->lo, p->hi);
+	malloc_error(tracenum, opnum, msg);
+	return 0;
     }
 
     /* 
      * Everything looks OK, so remember the extent of this block 
-     * by creating a range struct and adding it the range list.
+     * by creating a range struct and adding it the range tree, where
+     * it takes the place of the first range of lower priority on its 
+     * search path.
      */
-    if ((p = (range_t *)malloc(sizeof(range_t))) == NULL)
-	unix_error("malloc error in add_range");
-    p->next = *ranges;
-    p->lo = lo;
-    p->hi = hi;
-    *ranges = p;
+    p = new_range(lo, hi);
+    link = ranges;
+    while (*link != NULL && (*link)->priority > p->priority)
+	link = (lo < (*link)->lo) ? &(*link)->left : &(*link)->right;
+    split_ranges(*link, lo, &p->left, &p->right);
+    *link = p;
     return 1;
 }
 
@@ -433,32 +836,39 @@ static int add_range(range_t **ranges, char *lo, int size,
  */
 static void remove_range(range_t **ranges, char *lo)
 {
+    range_t **link = ranges;
     range_t *p;
-    range_t **prevpp = ranges;
-    int size;
 
-    for (p = *ranges;  p != NULL; p = p->next) {
-        if (p->lo == lo) {
-	    *prevpp = p->next;
-            size = p->hi - p->lo + 1;
-            free(p);
-            break;
-        }
-        prevpp = &(p->next);
+    while (*link != NULL && (*link)->lo != lo)
+	link = (lo < (*link)->lo) ? &(*link)->left : &(*link)->right;
+    if ((p = *link) != NULL) {
+	*link = merge_ranges(p->left, p->right);
+	p->left = range_pool;
+	range_pool = p;
     }
 }
 
 /*
- * clear_ranges - free all of the range records for a trace 
+ * clear_ranges - give all of the range records for a trace back to the pool 
  */
 static void clear_ranges(range_t **ranges)
 {
-    range_t *p;
-    range_t *pnext;
-
-    for (p = *ranges;  p != NULL;  p = pnext) {
-        pnext = p->next;
-        free(p);
+    range_t *p = *ranges;
+    range_t *l;
+
+    /* rotate left children up until there are none, which 
+       turns the tree into a list linked through right */
+    while (p != NULL) {
+	if ((l = p->left) != NULL) {
+	    p->left = l->right;
+	    l->right = p;
+	    p = l;
+	} else {
+	    l = p->right;
+	    p->left = range_pool;
+	    range_pool = p;
+	    p = l;
+	}
     }
     *ranges = NULL;
 }
@@ -469,7 +879,8 @@ static void clear_ranges(range_t **ranges)
  *********************************************/
 
 /*
- * read_trace - read a trace file and store it in memory
+ * read_trace - read a trace file and store it in memory, or map it 
+ *     if it is a binary trace
  */
 static trace_t *read_trace(char *tracedir, char *filename)
 {
@@ -477,7 +888,7 @@ static trace_t *read_trace(char *tracedir, char *filename)
     trace_t *trace;
     char type[MAXLINE];
     char path[MAXLINE];
-    unsigned index, size;
+    unsigned index, size, align, count;
     unsigned max_index = 0;
     unsigned op_index;
 
@@ -495,6 +906,11 @@ static trace_t *read_trace(char *tracedir, char *filename)
 	sprintf(msg, "Could not open %s in read_trace", path);
 	unix_error(msg);
     }
+    trace->map = NULL;
+    if (map_trace(trace, tracefile)) {
+	fclose(tracefile);
+	return trace;
+    }
     fscanf(tracefile, "%d", &(trace->sugg_heapsize)); /* not used */
     fscanf(tracefile, "%d", &(trace->num_ids));     
     fscanf(tracefile, "%d", &(trace->num_ops));     
@@ -534,11 +950,52 @@ static trace_t *read_trace(char *tracedir, char *filename)
 	    trace->ops[op_index].size = size;
 	    max_index = (index > max_index) ? index : max_index;
 	    break;
+	case 'c':
+	    fscanf(tracefile, "%u %u", &index, &size);
+	    trace->ops[op_index].type = CALLOC;
+	    trace->ops[op_index].index = index;
+	    trace->ops[op_index].size = size;
+	    max_index = (index > max_index) ? index : max_index;
+	    break;
+	case 'm':
+	    fscanf(tracefile, "%u %u %u", &index, &align, &size);
+	    if (align == 0 || (align & (align - 1)) != 0) {
+		printf("Bogus alignment (%u) in tracefile %s\n", align, path);
+		exit(1);
+	    }
+	    trace->ops[op_index].type = MEMALIGN;
+	    trace->ops[op_index].index = index;
+	    trace->ops[op_index].size = size;
+	    trace->ops[op_index].align = align;
+	    max_index = (index > max_index) ? index : max_index;
+	    break;
 	case 'f':
 	    fscanf(tracefile, "%ud", &index);
 	    trace->ops[op_index].type = FREE;
 	    trace->ops[op_index].index = index;
 	    break;
+	case 'A':
+	    fscanf(tracefile, "%u %u %u", &index, &count, &size);
+	    if (count == 0) {
+		printf("Empty batch in tracefile %s\n", path);
+		exit(1);
+	    }
+	    trace->ops[op_index].type = ALLOC_BATCH;
+	    trace->ops[op_index].index = index;
+	    trace->ops[op_index].count = count;
+	    trace->ops[op_index].size = size;
+	    max_index = (index + count - 1 > max_index) ? index + count - 1 : max_index;
+	    break;
+	case 'F':
+	    fscanf(tracefile, "%u %u", &index, &count);
+	    if (count == 0) {
+		printf("Empty batch in tracefile %s\n", path);
+		exit(1);
+	    }
+	    trace->ops[op_index].type = FREE_BATCH;
+	    trace->ops[op_index].index = index;
+	    trace->ops[op_index].count = count;
+	    break;
 	default:
 	    printf("Bogus type character (%c) in tracefile %s\n", 
 		   type[0], path);
@@ -554,18 +1011,206 @@ static trace_t *read_trace(char *tracedir, char *filename)
     return trace;
 }
 
+/*
+ * map_trace - If the open trace file is a binary trace, map it, read 
+ *     its header and allocate the arrays of the trace record. Return 0 
+ *     if it is a text trace, which is left to be read from the start.
+ */
+static int map_trace(trace_t *trace, FILE *tracefile)
+{
+    char magic[BINTRACE_MAGIC_LEN];
+    struct stat st;
+    const unsigned char *p;
+    unsigned long v[4];
+    int i;
+
+    if (fread(magic, 1, BINTRACE_MAGIC_LEN, tracefile) != BINTRACE_MAGIC_LEN ||
+	memcmp(magic, BINTRACE_MAGIC, BINTRACE_MAGIC_LEN) != 0) {
+	rewind(tracefile);
+	return 0;
+    }
+    if (fstat(fileno(tracefile), &st) < 0)
+	unix_error("fstat failed in map_trace");
+    trace->map_len = st.st_size;
+    trace->map = mmap(NULL, trace->map_len, PROT_READ, MAP_PRIVATE, 
+		      fileno(tracefile), 0);
+    if (trace->map == MAP_FAILED)
+	unix_error("mmap failed in map_trace");
+    if (trace->map[trace->map_len - 1] & 0x80)
+	app_error("Binary trace ends in the middle of a request");
+
+    /* the header is followed by the requests, which are decoded by next_op */
+    p = trace->map + BINTRACE_MAGIC_LEN;
+    for (i = 0; i < 4; i++) {
+	if (p >= trace->map + trace->map_len)
+	    app_error("Binary trace ends in its header");
+	p = get_varint(p, &v[i]);
+    }
+    trace->sugg_heapsize = v[0]; /* not used */
+    trace->num_ids = v[1];
+    trace->num_ops = v[2];
+    trace->weight = v[3];        /* not used */
+    trace->code = p;
+    trace->ops = NULL;
+
+    if ((trace->blocks = 
+	 (char **)malloc(trace->num_ids * sizeof(char *))) == NULL)
+	unix_error("malloc 3 failed in map_trace");
+    if ((trace->block_sizes = 
+	 (size_t *)malloc(trace->num_ids * sizeof(size_t))) == NULL)
+	unix_error("malloc 4 failed in map_trace");
+    return 1;
+}
+
 /*
  * free_trace - Free the trace record and the three arrays it points
- *              to, all of which were allocated in read_trace().
+ *              to, all of which were allocated in read_trace(), or 
+ *              unmap the file of a binary trace
  */
 void free_trace(trace_t *trace)
 {
+    if (trace->map != NULL)
+	munmap(trace->map, trace->map_len);
     free(trace->ops);         /* free the three arrays... */
     free(trace->blocks);      
     free(trace->block_sizes);
     free(trace);              /* and the trace record itself... */
 }
 
+/*
+ * start_ops - Start reading the requests of a trace from the first one
+ */
+static inline void start_ops(opreader_t *r, trace_t *trace)
+{
+    r->trace = trace;
+    r->i = 0;
+    r->p = trace->code;
+}
+
+/*
+ * next_op - Read the next request of a trace into *op, and return 0 
+ *     if there are none left. The requests of a binary trace are 
+ *     checked as they are decoded, since nothing checked them before.
+ */
+static inline int next_op(opreader_t *r, traceop_t *op)
+{
+    trace_t *trace = r->trace;
+    const unsigned char *end = trace->map + trace->map_len;
+    unsigned long v;
+
+    if (r->i == trace->num_ops)
+	return 0;
+    if (trace->ops != NULL) {
+	*op = trace->ops[r->i++];
+	return 1;
+    }
+
+    /* map_trace made sure that the last varint ends with the file, 
+       so no varint starting before the end is read past it */
+    if (r->p >= end)
+	app_error("Binary trace ends before its last request");
+    r->p = get_varint(r->p, &v);
+    op->type = v & BT_TYPE_MASK;
+    op->index = v >> BT_TYPE_BITS;
+    if (op->index >= trace->num_ids || op->type > FREE_BATCH)
+	app_error("Bogus request in binary trace");
+    op->size = 0;
+    if (op->type == MEMALIGN) {
+	if (r->p >= end)
+	    app_error("Binary trace ends before its last request");
+	r->p = get_varint(r->p, &v);
+	if (v == 0 || (v & (v - 1)) != 0)
+	    app_error("Bogus alignment in binary trace");
+	op->align = v;
+    }
+    if (op->type == ALLOC_BATCH || op->type == FREE_BATCH) {
+	if (r->p >= end)
+	    app_error("Binary trace ends before its last request");
+	r->p = get_varint(r->p, &v);
+	if (v == 0 || v > (unsigned long)(trace->num_ids - op->index))
+	    app_error("Bogus batch in binary trace");
+	op->count = v;
+    }
+    if (op->type != FREE && op->type != FREE_BATCH) {
+	if (r->p >= end)
+	    app_error("Binary trace ends before its last request");
+	r->p = get_varint(r->p, &v);
+	op->size = v;
+    }
+    r->i++;
+    return 1;
+}
+
+/*
+ * alloc_op - Make a request which allocates a new block, which is a 
+ *     malloc, a calloc or a memalign, with the functions of a package
+ */
+static inline void *alloc_op(const funcs_t *funcs, traceop_t *op)
+{
+    switch (op->type) {
+    case CALLOC:
+	return funcs->calloc_fn(1, op->size);
+    case MEMALIGN:
+	return funcs->memalign_fn(op->align, op->size);
+    default:
+	return funcs->malloc_fn(op->size);
+    }
+}
+
+/*
+ * libc_memalign - memalign of libc, by way of posix_memalign
+ */
+static void *libc_memalign(size_t align, size_t size)
+{
+    void *p;
+
+    if (align < sizeof(void *))
+	align = sizeof(void *);
+    return (posix_memalign(&p, align, size) == 0) ? p : NULL;
+}
+
+/*
+ * libc_malloc_batch, libc_free_batch - The batch requests with libc, 
+ *     which has no such calls, made by one malloc or free per block
+ */
+static size_t libc_malloc_batch(size_t size, size_t n, void **out)
+{
+    size_t k;
+
+    for (k = 0; k < n && (out[k] = malloc(size)) != NULL; k++)
+	;
+    return k;
+}
+
+static void libc_free_batch(void **ptrs, size_t n)
+{
+    size_t k;
+
+    for (k = 0; k < n; k++)
+	free(ptrs[k]);
+}
+
+/*
+ * mm_malloc_each, mm_free_each - The batch requests with one call of 
+ *     mm_malloc or mm_free per block, which -U measures them with
+ */
+static size_t mm_malloc_each(size_t size, size_t n, void **out)
+{
+    size_t k;
+
+    for (k = 0; k < n && (out[k] = mm_malloc(size)) != NULL; k++)
+	;
+    return k;
+}
+
+static void mm_free_each(void **ptrs, size_t n)
+{
+    size_t k;
+
+    for (k = 0; k < n; k++)
+	mm_free(ptrs[k]);
+}
+
 /**********************************************************************
  * The following functions evaluate the correctness, space utilization,
  * and throughput of the libc and mm malloc packages.
@@ -583,8 +1228,10 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
     char *newp;
     char *oldp;
     char *p;
+    opreader_t r;
+    traceop_t op;
     
-    /* Reset the heap and free any records in the range list */
+    /* Reset the heap and free any records in the range tree */
     mem_reset_brk();
     clear_ranges(ranges);
 
@@ -595,27 +1242,44 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
     }
 
     /* Interpret each operation in the trace in order */
-    for (i = 0;  i < trace->num_ops;  i++) {
-	index = trace->ops[i].index;
-	size = trace->ops[i].size;
+    for (start_ops(&r, trace), i = 0;  next_op(&r, &op);  i++) {
+	index = op.index;
+	size = op.size;
 
-        switch (trace->ops[i].type) {
+        switch (op.type) {
 
         case ALLOC: /* mm_malloc */
+        case CALLOC: /* mm_calloc */
+        case MEMALIGN: /* mm_memalign */
 
-	    /* Call the student's malloc */
-	    if ((p = mm_malloc(size)) == NULL) {
-		malloc_error(tracenum, i, "mm_malloc failed.");
+	    /* Call the student's malloc, calloc or memalign */
+	    if ((p = alloc_op(&mm_funcs, &op)) == NULL) {
+		malloc_error(tracenum, i, (op.type == ALLOC) ? "mm_malloc failed." :
+			     (op.type == CALLOC) ? "mm_calloc failed." : "mm_memalign failed.");
 		return 0;
 	    }
 	    
 	    /* 
 	     * Test the range of the new block for correctness and add it 
-	     * to the range list if OK. The block must be  be aligned properly,
+	     * to the range tree if OK. The block must be  be aligned properly,
 	     * and must not overlap any currently allocated block. 
 	     */ 
 	    if (add_range(ranges, p, size, tracenum, i) == 0)
 		return 0;
+
+	    /* A calloc must return zeros, and a memalign its alignment */
+	    if (op.type == CALLOC) {
+		for (j = 0; j < size; j++) {
+		    if (p[j] != 0) {
+			malloc_error(tracenum, i, "mm_calloc did not clear the block");
+			return 0;
+		    }
+		}
+	    }
+	    if (op.type == MEMALIGN && ((size_t)p & (op.align - 1)) != 0) {
+		malloc_error(tracenum, i, "mm_memalign did not align the block");
+		return 0;
+	    }
 	    
 	    /* ADDED: cgw
 	     * fill range with low byte of index.  This will be used later
@@ -638,10 +1302,10 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
 		return 0;
 	    }
 	    
-	    /* Remove the old region from the range list */
+	    /* Remove the old region from the range tree */
 	    remove_range(ranges, oldp);
 	    
-	    /* Check new block for correctness and add it to range list */
+	    /* Check new block for correctness and add it to range tree */
 	    if (add_range(ranges, newp, size, tracenum, i) == 0)
 		return 0;
 	    
@@ -653,7 +1317,7 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
 	    oldsize = trace->block_sizes[index];
 	    if (size < oldsize) oldsize = size;
 	    for (j = 0; j < oldsize; j++) {
-	      if (newp[j] != (index & 0xFF)) {
+	      if ((unsigned char)newp[j] != (index & 0xFF)) {
 		malloc_error(tracenum, i, "mm_realloc did not preserve the "
 			     "data from old block");
 		return 0;
@@ -674,10 +1338,44 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
 	    mm_free(p);
 	    break;
 
+	case ALLOC_BATCH: /* mm_malloc_batch */
+
+	    /* Every block of the batch is checked and filled like one 
+	       allocated by mm_malloc */
+	    if (mm_funcs.malloc_batch_fn(size, op.count, 
+					 (void **)&trace->blocks[index]) != op.count) {
+		malloc_error(tracenum, i, "mm_malloc_batch failed.");
+		return 0;
+	    }
+	    for (j = 0; j < op.count; j++) {
+		p = trace->blocks[index + j];
+		if (add_range(ranges, p, size, tracenum, i) == 0)
+		    return 0;
+		memset(p, (index + j) & 0xFF, size);
+		trace->block_sizes[index + j] = size;
+	    }
+	    break;
+
+	case FREE_BATCH: /* mm_free_batch */
+	    for (j = 0; j < op.count; j++)
+		remove_range(ranges, trace->blocks[index + j]);
+	    mm_funcs.free_batch_fn((void **)&trace->blocks[index], op.count);
+	    break;
+
 	default:
 	    app_error("Nonexistent request type in eval_mm_valid");
         }
 
+	/* Check the blocks the request touched, and now and then the 
+	   whole heap, so that a corruption is caught where it happens */
+	if (mm_check(check_full || (i + 1) % CHECK_EVERY == 0) < 0) {
+	    malloc_error(tracenum, i, "mm_check found the heap inconsistent.");
+	    return 0;
+	}
+    }
+    if (mm_check(1) < 0) {
+	malloc_error(tracenum, i - 1, "mm_check found the heap inconsistent.");
+	return 0;
     }
 
     /* As far as we know, this is a valid malloc package */
@@ -689,35 +1387,64 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
  *   The idea is to remember the high water mark "hwm" of the heap for 
  *   an optimal allocator, i.e., no gaps and no internal fragmentation.
  *   Utilization is the ratio hwm/heapsize, where heapsize is the 
- *   size of the heap in bytes after running the student's malloc 
- *   package on the trace. Note that our implementation of mem_sbrk() 
- *   doesn't allow the students to decrement the brk pointer, so brk
- *   is always the high water mark of the heap. 
- *   
+ *   largest size of the heap in bytes while running the student's 
+ *   malloc package on the trace. Since mem_sbrk() lets the package 
+ *   decrement the brk pointer, this is mem_peak_heapsize() rather 
+ *   than the size of the heap at the end. 
+ *
+ *   The average overhead per allocated block (the bytes the package 
+ *   uses beyond the payloads, divided by the number of blocks) is 
+ *   sampled from mm_stats() at the same high water mark and returned 
+ *   in *ovhd. The fraction of small mallocs served by the thread cache 
+ *   of mm.c over the whole trace is returned in *hit, and the number 
+ *   of payload bytes mm_realloc had to copy in *copied. The bytes of 
+ *   the heap still resident in memory once the trace is done, after 
+ *   the package has given back what it could, are returned in *rss.
+ *   If frag is not NULL, the free blocks of the heap are sampled into 
+ *   it at evenly spaced requests of the trace. If snap is not NULL, 
+ *   the request after which the heap was largest is returned in 
+ *   snap->peak_op, every request sets its index as the site of mm.c, 
+ *   and a snapshot of the heap is written after request snap->dump_op.
  */
-static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
+static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges,
+			   double *ovhd, double *hit, double *copied, double *rss,
+			   frag_t *frag, snap_t *snap)
 {   
-    int i;
-    int index;
+    int i, j, index;
     int size, newsize, oldsize;
-    int max_total_size = 0;
-    int total_size = 0;
+    long max_total_size = 0;
+    long total_size = 0;
     char *p;
     char *newp, *oldp;
-
-    /* initialize the heap and the mm malloc package */
+    mm_stats_t st;
+    opreader_t r;
+    traceop_t op;
+    int sample_every = (trace->num_ops + FRAG_SAMPLES - 1) / FRAG_SAMPLES;
+    size_t peak = 0;
+
+    *ovhd = 0;
+    if (sample_every == 0)
+	sample_every = 1;
+
+    /* initialize the heap and the mm malloc package, with none of the 
+       pages touched by earlier runs resident */
     mem_reset_brk();
+    mem_release(mem_heap_lo(), (char *)mem_heap_lo() + MAX_HEAP);
     if (mm_init() < 0)
 	app_error("mm_init failed in eval_mm_util");
 
-    for (i = 0;  i < trace->num_ops;  i++) {
-        switch (trace->ops[i].type) {
+    for (start_ops(&r, trace), i = 0;  next_op(&r, &op);  i++) {
+	if (snap != NULL)
+	    mm_set_site(i);
+        switch (op.type) {
 
         case ALLOC: /* mm_alloc */
-	    index = trace->ops[i].index;
-	    size = trace->ops[i].size;
+        case CALLOC: /* mm_calloc */
+        case MEMALIGN: /* mm_memalign */
+	    index = op.index;
+	    size = op.size;
 
-	    if ((p = mm_malloc(size)) == NULL) 
+	    if ((p = alloc_op(&mm_funcs, &op)) == NULL) 
 		app_error("mm_malloc failed in eval_mm_util");
 	    
 	    /* Remember region and size */
@@ -729,13 +1456,16 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
 	    total_size += size;
 	    
 	    /* Update statistics */
-	    max_total_size = (total_size > max_total_size) ?
-		total_size : max_total_size;
+	    if (total_size > max_total_size) {
+		max_total_size = total_size;
+		mm_stats(&st);
+		*ovhd = ((double)st.alloc_bytes - (double)total_size) / st.alloc_blocks;
+	    }
 	    break;
 
 	case REALLOC: /* mm_realloc */
-	    index = trace->ops[i].index;
-	    newsize = trace->ops[i].size;
+	    index = op.index;
+	    newsize = op.size;
 	    oldsize = trace->block_sizes[index];
 
 	    oldp = trace->blocks[index];
@@ -751,12 +1481,15 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
 	    total_size += (newsize - oldsize);
 	    
 	    /* Update statistics */
-	    max_total_size = (total_size > max_total_size) ?
-		total_size : max_total_size;
+	    if (total_size > max_total_size) {
+		max_total_size = total_size;
+		mm_stats(&st);
+		*ovhd = ((double)st.alloc_bytes - (double)total_size) / st.alloc_blocks;
+	    }
 	    break;
 
         case FREE: /* mm_free */
-	    index = trace->ops[i].index;
+	    index = op.index;
 	    size = trace->block_sizes[index];
 	    p = trace->blocks[index];
 	    
@@ -768,13 +1501,64 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
 	    
 	    break;
 
+	case ALLOC_BATCH: /* mm_malloc_batch */
+	    index = op.index;
+	    size = op.size;
+
+	    if (mm_funcs.malloc_batch_fn(size, op.count, 
+					 (void **)&trace->blocks[index]) != op.count)
+		app_error("mm_malloc_batch failed in eval_mm_util");
+	    for (j = 0; j < op.count; j++)
+		trace->block_sizes[index + j] = size;
+	    total_size += (long)size * op.count;
+
+	    /* Update statistics */
+	    if (total_size > max_total_size) {
+		max_total_size = total_size;
+		mm_stats(&st);
+		*ovhd = ((double)st.alloc_bytes - (double)total_size) / st.alloc_blocks;
+	    }
+	    break;
+
+	case FREE_BATCH: /* mm_free_batch */
+	    index = op.index;
+	    for (j = 0; j < op.count; j++)
+		total_size -= trace->block_sizes[index + j];
+	    mm_funcs.free_batch_fn((void **)&trace->blocks[index], op.count);
+	    break;
+
 	default:
 	    app_error("Nonexistent request type in eval_mm_util");
 
         }
+
+	/* Sample the free blocks after every sample_every requests */
+	if (frag != NULL && (i + 1) % sample_every == 0)
+	    frag_sample(frag);
+
+	/* Find the peak of the heap, and take the snapshot */
+	if (snap != NULL) {
+	    if (mem_heapsize() > peak) {
+		peak = mem_heapsize();
+		snap->peak_op = i;
+	    }
+	    if (i == snap->dump_op)
+		write_snapshot(snap);
+	}
     }
 
-    return ((double)max_total_size / (double)mem_heapsize());
+    /* Hit rate of the thread cache over the whole trace */
+    mm_stats(&st);
+    *hit = 0;
+    if (st.tcache_hits + st.tcache_misses > 0)
+	*hit = (double)st.tcache_hits / (st.tcache_hits + st.tcache_misses);
+    *copied = st.realloc_copied;
+    *rss = mem_rss();
+    if (frag != NULL && st.searches > 0)
+	frag->steps = (double)st.search_steps / st.searches;
+
+    /* the heap may have been trimmed, so its peak size is used */
+    return ((double)max_total_size / (double)mem_peak_heapsize());
 }
 
 
@@ -784,9 +1568,11 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
  */
 static void eval_mm_speed(void *ptr)
 {
-    int i, index, size, newsize;
+    int index, newsize;
     char *p, *newp, *oldp, *block;
     trace_t *trace = ((speed_t *)ptr)->trace;
+    opreader_t r;
+    traceop_t op;
 
     /* Reset the heap and initialize the mm package */
     mem_reset_brk();
@@ -794,20 +1580,21 @@ static void eval_mm_speed(void *ptr)
 	app_error("mm_init failed in eval_mm_speed");
 
     /* Interpret each trace request */
-    for (i = 0;  i < trace->num_ops;  i++)
-        switch (trace->ops[i].type) {
+    for (start_ops(&r, trace);  next_op(&r, &op); )
+        switch (op.type) {
 
         case ALLOC: /* mm_malloc */
-            index = trace->ops[i].index;
-            size = trace->ops[i].size;
-            if ((p = mm_malloc(size)) == NULL)
+        case CALLOC: /* mm_calloc */
+        case MEMALIGN: /* mm_memalign */
+            index = op.index;
+            if ((p = alloc_op(&mm_funcs, &op)) == NULL)
 		app_error("mm_malloc error in eval_mm_speed");
             trace->blocks[index] = p;
             break;
 
 	case REALLOC: /* mm_realloc */
-	    index = trace->ops[i].index;
-            newsize = trace->ops[i].size;
+	    index = op.index;
+            newsize = op.size;
 	    oldp = trace->blocks[index];
             if ((newp = mm_realloc(oldp,newsize)) == NULL)
 		app_error("mm_realloc error in eval_mm_speed");
@@ -815,16 +1602,292 @@ static void eval_mm_speed(void *ptr)
             break;
 
         case FREE: /* mm_free */
-            index = trace->ops[i].index;
+            index = op.index;
             block = trace->blocks[index];
             mm_free(block);
             break;
 
+	case ALLOC_BATCH: /* mm_malloc_batch */
+	    if (mm_funcs.malloc_batch_fn(op.size, op.count, 
+					 (void **)&trace->blocks[op.index]) != op.count)
+		app_error("mm_malloc_batch error in eval_mm_speed");
+	    break;
+
+	case FREE_BATCH: /* mm_free_batch */
+	    mm_funcs.free_batch_fn((void **)&trace->blocks[op.index], op.count);
+	    break;
+
 	default:
 	    app_error("Nonexistent request type in eval_mm_valid");
         }
 }
 
+/*
+ * free_inbox - Free the blocks handed to a thread by the previous one
+ */
+static void free_inbox(replay_t *replay)
+{
+    handoff_t *h = __atomic_exchange_n(&replay->inbox, NULL, __ATOMIC_ACQUIRE);
+
+    for (; h != NULL; h = h->next)
+	replay->params->funcs->free_fn(h->block);
+}
+
+/*
+ * hand_off - Hand a block over to the next thread, which frees it.
+ *    The handoff is pushed onto a lock-free stack, the inbox of that 
+ *    thread, which it empties before each of its own requests.
+ */
+static void hand_off(replay_t *replay, int index, char *block)
+{
+    threads_t *params = replay->params;
+    replay_t *next = &params->replay[(replay->id + 1) % params->nthreads];
+    handoff_t *h = &replay->handoffs[index];
+
+    h->block = block;
+    h->next = __atomic_load_n(&next->inbox, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&next->inbox, &h->next, h, 1,
+					__ATOMIC_RELEASE, __ATOMIC_RELAXED))
+	;
+}
+
+/*
+ * replay_trace - The body of each thread started by eval_threads.
+ *    Every thread makes the requests of the whole trace on its own
+ *    blocks, so that the threads share nothing but the malloc package,
+ *    except for the blocks whose frees are handed to the next thread.
+ */
+static void *replay_trace(void *ptr)
+{
+    int index, newsize;
+    char *p, *newp, *oldp, *block;
+    replay_t *replay = (replay_t *)ptr;
+    threads_t *params = replay->params;
+    const funcs_t *funcs = params->funcs;
+    trace_t *trace = replay->trace;
+    char **blocks = replay->blocks;
+    int cross = (params->nthreads > 1) ? params->cross : 0;
+    opreader_t r;
+    traceop_t op;
+
+    /* Interpret each trace request */
+    for (start_ops(&r, trace);  !replay->failed && next_op(&r, &op); ) {
+	if (__atomic_load_n(&replay->inbox, __ATOMIC_RELAXED) != NULL)
+	    free_inbox(replay);
+
+        switch (op.type) {
+
+        case ALLOC: /* malloc */
+        case CALLOC: /* calloc */
+        case MEMALIGN: /* memalign */
+            index = op.index;
+            if ((p = alloc_op(funcs, &op)) == NULL) {
+		replay->failed = 1;
+		break;
+	    }
+            blocks[index] = p;
+            break;
+
+	case REALLOC: /* realloc */
+	    index = op.index;
+            newsize = op.size;
+	    oldp = blocks[index];
+            if ((newp = funcs->realloc_fn(oldp,newsize)) == NULL) {
+		replay->failed = 1;
+		break;
+	    }
+            blocks[index] = newp;
+            break;
+
+        case FREE: /* free */
+            index = op.index;
+            block = blocks[index];
+	    if (CROSS_FREE(index, cross))
+		hand_off(replay, index, block);
+	    else
+		funcs->free_fn(block);
+            break;
+
+	case ALLOC_BATCH: /* malloc_batch */
+	    if (funcs->malloc_batch_fn(op.size, op.count, 
+				       (void **)&blocks[op.index]) != op.count)
+		replay->failed = 1;
+	    break;
+
+	case FREE_BATCH: /* free_batch, whose blocks are never handed over */
+	    funcs->free_batch_fn((void **)&blocks[op.index], op.count);
+	    break;
+
+	default:
+	    app_error("Nonexistent request type in replay_trace");
+        }
+    }
+
+    /* Blocks may be handed over until the last thread is done */
+    pthread_barrier_wait(&params->done);
+    free_inbox(replay);
+    return NULL;
+}
+
+/*
+ * eval_threads - This is the function that is used by fsecs()
+ *    to measure the running time of the mm or libc malloc package 
+ *    when a trace is replayed by several threads at the same time.
+ *    With mm.c, each thread is given its own arena.
+ */
+static void eval_threads(void *ptr)
+{
+    int i;
+    pthread_t tid[MAX_THREADS];
+    threads_t *params = (threads_t *)ptr;
+
+    /* Reset the heap and initialize the mm package */
+    if (params->funcs == &mm_funcs) {
+	mem_reset_brk();
+	mm_set_arenas(params->nthreads);
+	if (mm_init() < 0) 
+	    app_error("mm_init failed in eval_threads");
+    }
+
+    pthread_barrier_init(&params->done, NULL, params->nthreads);
+    for (i = 0; i < params->nthreads; i++)
+	if (pthread_create(&tid[i], NULL, replay_trace, &params->replay[i]) != 0)
+	    unix_error("pthread_create failed in eval_threads");
+    for (i = 0; i < params->nthreads; i++)
+	pthread_join(tid[i], NULL);
+    pthread_barrier_destroy(&params->done);
+}
+
+/*
+ * print_scaling - Print the throughput of a package with some number 
+ *    of threads, its speedup over a single thread and its efficiency, 
+ *    which is the speedup divided by the number of threads
+ */
+static void print_scaling(double kops, double kops1, int nthreads)
+{
+    if (kops <= 0) {
+	printf("%10s%9s%6s", "-", "-", "-");
+	return;
+    }
+    printf("%10.0f", kops);
+    if (kops1 > 0)
+	printf("%8.2fx%5.0f%%", kops/kops1, 100.0*kops/kops1/nthreads);
+    else
+	printf("%9s%6s", "-", "-");
+}
+
+/*
+ * eval_mm_scaling - Replay each trace with 1, 2, 4, ... threads up to
+ *    max_threads, with mm.c and with libc, and print the aggregate 
+ *    throughput of all threads together with the speedup over a single 
+ *    thread and the efficiency. With cross > 0, that percentage of 
+ *    the frees is handed to another thread.
+ */
+static void eval_mm_scaling(int n, char **tracefiles, int max_threads, 
+			    int cross)
+{
+    int i, j, k, t, failed;
+    trace_t *trace;
+    threads_t *params;
+    double secs, ops;
+    double kops[2], kops1[2];
+    double *tot_secs[2], *tot_ops; /* totals over the traces per thread count */
+    int *tot_valid[2];
+    int nrounds = 0;
+    int nthreads[MAX_THREADS];
+    const funcs_t *funcs[2] = {&mm_funcs, &libc_funcs};
+
+    /* The thread counts are the powers of two below max_threads and max_threads */
+    for (t = 1; t < max_threads; t *= 2)
+	nthreads[nrounds++] = t;
+    nthreads[nrounds++] = max_threads;
+
+    if ((params = (threads_t *)calloc(1, sizeof(threads_t))) == NULL ||
+	(tot_ops = (double *)calloc(nrounds, sizeof(double))) == NULL)
+	unix_error("calloc in eval_mm_scaling failed");
+    for (k = 0; k < 2; k++)
+	if ((tot_secs[k] = (double *)calloc(nrounds, sizeof(double))) == NULL ||
+	    (tot_valid[k] = (int *)calloc(nrounds, sizeof(int))) == NULL)
+	    unix_error("calloc in eval_mm_scaling failed");
+    params->cross = cross;
+
+    printf("Scaling of mm malloc and libc malloc with up to %d threads", 
+	   max_threads);
+    if (cross > 0)
+	printf(", %d%% of the frees by another thread", cross);
+    printf(":\n%5s%8s%10s%10s%9s%6s%10s%9s%6s\n", "trace", "threads", "ops", 
+	   "mm Kops", "speedup", "eff", "libc Kops", "speedup", "eff");
+    for (i = 0; i < n; i++) {
+	trace = read_trace(tracedir, tracefiles[i]);
+	for (t = 0; t < max_threads; t++) {
+	    params->replay[t].trace = trace;
+	    params->replay[t].params = params;
+	    params->replay[t].id = t;
+	    if ((params->replay[t].blocks = 
+		 (char **)calloc(trace->num_ids, sizeof(char *))) == NULL ||
+		(params->replay[t].handoffs = 
+		 (handoff_t *)calloc(trace->num_ids, sizeof(handoff_t))) == NULL)
+		unix_error("calloc in eval_mm_scaling failed");
+	}
+	kops1[0] = kops1[1] = 0;
+	for (j = 0; j < nrounds; j++) {
+	    params->nthreads = nthreads[j];
+	    ops = (double)trace->num_ops * nthreads[j];
+	    for (k = 0; k < 2; k++) {
+		params->funcs = funcs[k];
+		for (t = 0; t < nthreads[j]; t++)
+		    params->replay[t].failed = 0;
+		secs = fsecs(eval_threads, params);
+		failed = 0;
+		for (t = 0; t < nthreads[j]; t++)
+		    failed |= params->replay[t].failed;
+		kops[k] = 0;
+		if (!failed) {
+		    kops[k] = (ops/1e3)/secs;
+		    tot_secs[k][j] += secs;
+		    tot_valid[k][j]++;
+		}
+		if (j == 0)
+		    kops1[k] = kops[k];
+	    }
+	    tot_ops[j] += ops;
+	    printf("%2d%11d%10.0f", i, nthreads[j], ops);
+	    print_scaling(kops[0], kops1[0], nthreads[j]);
+	    print_scaling(kops[1], kops1[1], nthreads[j]);
+	    printf("%s\n", (kops[0] > 0 && kops[1] > 0) ? "" : "  (out of memory)");
+	}
+	for (t = 0; t < max_threads; t++) {
+	    free(params->replay[t].blocks);
+	    free(params->replay[t].handoffs);
+	}
+	free_trace(trace);
+    }
+
+    /* Print the aggregate results for each number of threads, which 
+       are only comparable if the same traces ran with them */
+    for (j = 0; j < nrounds; j++) {
+	printf("%5s%8d%10.0f", "Total", nthreads[j], tot_ops[j]);
+	for (k = 0; k < 2; k++) {
+	    if (tot_valid[k][j] == n)
+		print_scaling((tot_ops[j]/1e3)/tot_secs[k][j],
+			      (tot_valid[k][0] == n) ? (tot_ops[0]/1e3)/tot_secs[k][0] : 0,
+			      nthreads[j]);
+	    else
+		print_scaling(0, 0, nthreads[j]);
+	}
+	printf("\n");
+    }
+
+    /* Leave the mm package with a single arena for later runs */
+    mm_set_arenas(1);
+    free(params);
+    free(tot_ops);
+    for (k = 0; k < 2; k++) {
+	free(tot_secs[k]);
+	free(tot_valid[k]);
+    }
+}
+
 /*
  * eval_libc_valid - We run this function to make sure that the
  *    libc malloc can run to completion on the set of traces.
@@ -835,30 +1898,46 @@ static int eval_libc_valid(trace_t *trace, int tracenum)
 {
     int i, newsize;
     char *p, *newp, *oldp;
+    opreader_t r;
+    traceop_t op;
 
-    for (i = 0;  i < trace->num_ops;  i++) {
-        switch (trace->ops[i].type) {
+    for (start_ops(&r, trace), i = 0;  next_op(&r, &op);  i++) {
+        switch (op.type) {
 
         case ALLOC: /* malloc */
-	    if ((p = malloc(trace->ops[i].size)) == NULL) {
+        case CALLOC: /* calloc */
+        case MEMALIGN: /* memalign */
+	    if ((p = alloc_op(&libc_funcs, &op)) == NULL) {
 		malloc_error(tracenum, i, "libc malloc failed");
 		unix_error("System message");
 	    }
-	    trace->blocks[trace->ops[i].index] = p;
+	    trace->blocks[op.index] = p;
 	    break;
 
 	case REALLOC: /* realloc */
-            newsize = trace->ops[i].size;
-	    oldp = trace->blocks[trace->ops[i].index];
+            newsize = op.size;
+	    oldp = trace->blocks[op.index];
 	    if ((newp = realloc(oldp, newsize)) == NULL) {
 		malloc_error(tracenum, i, "libc realloc failed");
 		unix_error("System message");
 	    }
-	    trace->blocks[trace->ops[i].index] = newp;
+	    trace->blocks[op.index] = newp;
 	    break;
 	    
         case FREE: /* free */
-	    free(trace->blocks[trace->ops[i].index]);
+	    free(trace->blocks[op.index]);
+	    break;
+
+	case ALLOC_BATCH: /* malloc of each block */
+	    if (libc_malloc_batch(op.size, op.count, 
+				  (void **)&trace->blocks[op.index]) != op.count) {
+		malloc_error(tracenum, i, "libc malloc failed");
+		unix_error("System message");
+	    }
+	    break;
+
+	case FREE_BATCH: /* free of each block */
+	    libc_free_batch((void **)&trace->blocks[op.index], op.count);
 	    break;
 
 	default:
@@ -876,24 +1955,26 @@ static int eval_libc_valid(trace_t *trace, int tracenum)
  */
 static void eval_libc_speed(void *ptr)
 {
-    int i;
-    int index, size, newsize;
+    int index, newsize;
     char *p, *newp, *oldp, *block;
     trace_t *trace = ((speed_t *)ptr)->trace;
+    opreader_t r;
+    traceop_t op;
 
-    for (i = 0;  i < trace->num_ops;  i++) {
-        switch (trace->ops[i].type) {
+    for (start_ops(&r, trace);  next_op(&r, &op); ) {
+        switch (op.type) {
         case ALLOC: /* malloc */
-	    index = trace->ops[i].index;
-	    size = trace->ops[i].size;
-	    if ((p = malloc(size)) == NULL)
+        case CALLOC: /* calloc */
+        case MEMALIGN: /* memalign */
+	    index = op.index;
+	    if ((p = alloc_op(&libc_funcs, &op)) == NULL)
 		unix_error("malloc failed in eval_libc_speed");
 	    trace->blocks[index] = p;
 	    break;
 
 	case REALLOC: /* realloc */
-	    index = trace->ops[i].index;
-	    newsize = trace->ops[i].size;
+	    index = op.index;
+	    newsize = op.size;
 	    oldp = trace->blocks[index];
 	    if ((newp = realloc(oldp, newsize)) == NULL)
 		unix_error("realloc failed in eval_libc_speed\n");
@@ -902,71 +1983,495 @@ static void eval_libc_speed(void *ptr)
 	    break;
 	    
         case FREE: /* free */
-	    index = trace->ops[i].index;
+	    index = op.index;
 	    block = trace->blocks[index];
 	    free(block);
 	    break;
+
+	case ALLOC_BATCH: /* malloc of each block */
+	    if (libc_malloc_batch(op.size, op.count, 
+				  (void **)&trace->blocks[op.index]) != op.count)
+		unix_error("malloc failed in eval_libc_speed");
+	    break;
+
+	case FREE_BATCH: /* free of each block */
+	    libc_free_batch((void **)&trace->blocks[op.index], op.count);
+	    break;
 	}
     }
 }
 
+/*****************************************************************
+ * The following routines measure the latency of every request of a
+ * trace in CPU cycles, read with rdtsc around each call. This runs
+ * in a pass of its own after the throughput has been measured, so
+ * that reading the counter does not slow down the timed runs.
+ *
+ * The latencies are counted in a histogram in the manner of HDR
+ * histograms: a value v of at least HIST_SUB goes to a bucket for
+ * the power of two at or below v, split into HIST_SUB sub-buckets, 
+ * so every bucket is within 1/HIST_SUB of the values it holds.
+ ****************************************************************/
+
+/*
+ * read_tsc - Read the time stamp counter
+ */
+static inline unsigned long long read_tsc(void)
+{
+    unsigned hi, lo;
+
+    asm volatile("rdtsc" : "=a" (lo), "=d" (hi));
+    return ((unsigned long long)hi << 32) | lo;
+}
+
+/*
+ * hist_index - The bucket of a value
+ */
+static inline int hist_index(unsigned long long v)
+{
+    int e;
+
+    if (v < HIST_SUB)
+	return v;
+    e = 63 - __builtin_clzll(v);
+    return ((e - HIST_SUB_BITS + 1) << HIST_SUB_BITS) + 
+	(int)((v >> (e - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+/*
+ * hist_value - The highest value of a bucket
+ */
+static unsigned long long hist_value(int i)
+{
+    int shift;
+
+    if (i < HIST_SUB)
+	return i;
+    shift = (i >> HIST_SUB_BITS) - 1;
+    return ((unsigned long long)(HIST_SUB + (i & (HIST_SUB - 1)) + 1) << shift) - 1;
+}
+
+/*
+ * hist_add - Count a value in a histogram
+ */
+static inline void hist_add(hist_t *h, unsigned long long v)
+{
+    h->counts[hist_index(v)]++;
+    h->count++;
+    if (v > h->max)
+	h->max = v;
+}
+
+/*
+ * hist_merge - Add the counts of histogram b to those of histogram a
+ */
+static void hist_merge(hist_t *a, hist_t *b)
+{
+    int i;
+
+    for (i = 0; i < HIST_BUCKETS; i++)
+	a->counts[i] += b->counts[i];
+    a->count += b->count;
+    if (b->max > a->max)
+	a->max = b->max;
+}
+
+/*
+ * hist_percentile - The value below which a fraction q of the values 
+ *     of a nonempty histogram lie, rounded up to the end of its bucket
+ */
+static unsigned long long hist_percentile(hist_t *h, double q)
+{
+    unsigned long long target = (unsigned long long)(q * h->count + 0.5);
+    unsigned long long seen = 0;
+    int i;
+
+    if (target == 0)
+	target = 1;
+    for (i = 0; i < HIST_BUCKETS; i++) {
+	seen += h->counts[i];
+	if (seen >= target)
+	    return hist_value(i) < h->max ? hist_value(i) : h->max;
+    }
+    return h->max;
+}
+
+/*
+ * tsc_overhead - The smallest number of cycles between two reads of 
+ *     the counter, which is taken off every latency
+ */
+static unsigned long long tsc_overhead(void)
+{
+    unsigned long long t, best = ~0ULL;
+    int i;
+
+    for (i = 0; i < 1000; i++) {
+	t = read_tsc();
+	t = read_tsc() - t;
+	if (t < best)
+	    best = t;
+    }
+    return best;
+}
+
+/*
+ * eval_mm_latency - Replay a trace with the mm package, counting the 
+ *     latency of every request in the histogram of its type
+ */
+static void eval_mm_latency(trace_t *trace, hist_t *hists)
+{
+    int index;
+    unsigned long long t, overhead = tsc_overhead();
+    size_t k;
+    char *p;
+    opreader_t r;
+    traceop_t op;
+
+    mem_reset_brk();
+    if (mm_init() < 0)
+	app_error("mm_init failed in eval_mm_latency");
+
+    for (start_ops(&r, trace);  next_op(&r, &op); ) {
+	index = op.index;
+	switch (op.type) {
+	case ALLOC: /* mm_malloc */
+	case CALLOC: /* mm_calloc */
+	case MEMALIGN: /* mm_memalign */
+	    t = read_tsc();
+	    p = alloc_op(&mm_funcs, &op);
+	    t = read_tsc() - t;
+	    if (p == NULL)
+		app_error("mm_malloc failed in eval_mm_latency");
+	    trace->blocks[index] = p;
+	    break;
+
+	case REALLOC: /* mm_realloc */
+	    t = read_tsc();
+	    p = mm_realloc(trace->blocks[index], op.size);
+	    t = read_tsc() - t;
+	    if (p == NULL)
+		app_error("mm_realloc failed in eval_mm_latency");
+	    trace->blocks[index] = p;
+	    break;
+
+	case FREE: /* mm_free */
+	    t = read_tsc();
+	    mm_free(trace->blocks[index]);
+	    t = read_tsc() - t;
+	    break;
+
+	case ALLOC_BATCH: /* mm_malloc_batch */
+	    t = read_tsc();
+	    k = mm_funcs.malloc_batch_fn(op.size, op.count, (void **)&trace->blocks[index]);
+	    t = read_tsc() - t;
+	    if (k != op.count)
+		app_error("mm_malloc_batch failed in eval_mm_latency");
+	    break;
+
+	case FREE_BATCH: /* mm_free_batch */
+	    t = read_tsc();
+	    mm_funcs.free_batch_fn((void **)&trace->blocks[index], op.count);
+	    t = read_tsc() - t;
+	    break;
+
+	default:
+	    app_error("Nonexistent request type in eval_mm_latency");
+	}
+	hist_add(&hists[op.type], t > overhead ? t - overhead : 0);
+    }
+}
+
+/*
+ * print_latency - Print the percentiles of the latencies of each type 
+ *     of request for every trace, followed by those of all traces
+ */
+static void print_latency(int n, hist_t (*hists)[NUM_OP_TYPES])
+{
+    static char *names[NUM_OP_TYPES] = {"malloc", "free", "realloc", "calloc", "memalign",
+					"mbatch", "fbatch"};
+    hist_t *total;
+    hist_t *h;
+    int i, k;
+
+    if ((total = (hist_t *)calloc(NUM_OP_TYPES, sizeof(hist_t))) == NULL)
+	unix_error("calloc in print_latency failed");
+
+    printf("Latency of mm malloc in cycles:\n");
+    printf("%5s%9s%9s%8s%8s%8s%10s\n", 
+	   "trace", "op", "ops", "p50", "p99", "p999", "max");
+    for (i = 0; i <= n; i++) {
+	for (k = 0; k < NUM_OP_TYPES; k++) {
+	    if (i < n)
+		hist_merge(&total[k], &hists[i][k]);
+	    h = (i < n) ? &hists[i][k] : &total[k];
+	    if (h->count == 0)
+		continue;
+	    if (i < n)
+		printf("%2d", i);
+	    else
+		printf("%5s", "Total");
+	    printf("%*s%9llu%8llu%8llu%8llu%10llu\n", (i < n) ? 12 : 9, 
+		   names[k], h->count,
+		   hist_percentile(h, 0.50), hist_percentile(h, 0.99),
+		   hist_percentile(h, 0.999), h->max);
+	}
+    }
+    free(total);
+}
+
+/*****************************************************************
+ * The following routines sample the free blocks of the heap of mm.c 
+ * with mm_stats() while a trace is replayed, and plot how fragmented
+ * the heap was over the course of each trace.
+ ****************************************************************/
+
+/*
+ * frag_sample - Record the free bytes of the heap and how fragmented 
+ *     they are, unless all the samples have been taken
+ */
+static void frag_sample(frag_t *frag)
+{
+    mm_stats_t st;
+    size_t heapsize = mem_heapsize();
+
+    if (frag->n == FRAG_SAMPLES)
+	return;
+    mm_stats(&st);
+    frag->free[frag->n] = heapsize ? (double)st.free_bytes / heapsize : 0;
+    frag->ext[frag->n] = st.ext_frag;
+    frag->n++;
+    if (st.free_blocks > frag->max_blocks)
+	frag->max_blocks = st.free_blocks;
+    if (st.largest_free > frag->max_largest)
+	frag->max_largest = st.largest_free;
+}
+
+/*
+ * print_frag - Plot the samples of every trace as two rows of 
+ *     characters, one per sample, from ' ' for 0% to '@' for 100%:
+ *     the free bytes as a fraction of the heap, and the external 
+ *     fragmentation of the free bytes, 1 - largest free block / free bytes
+ */
+static void print_frag(int n, frag_t *frags)
+{
+    static char levels[] = " .:-=+*#%@";
+    int nlevels = sizeof(levels) - 1;
+    int i, k;
+
+    printf("Fragmentation of mm malloc over each trace "
+	   "(' ' is 0%%, '@' is 100%%):\n");
+    printf("%5s%7s%-*s %8s%10s%7s\n", "trace", "", FRAG_SAMPLES, 
+	   "free bytes / heap, external fragmentation", "blocks", "largest", "steps");
+    for (i = 0; i < n; i++) {
+	printf("%2d%9s", i, "free |");
+	for (k = 0; k < frags[i].n; k++)
+	    putchar(levels[(int)(frags[i].free[k] * (nlevels - 1) + 0.5)]);
+	printf("%*s|%8lu%10lu%7.1f\n", FRAG_SAMPLES - frags[i].n, "",
+	       (unsigned long)frags[i].max_blocks, 
+	       (unsigned long)frags[i].max_largest, frags[i].steps);
+	printf("%2s%9s", "", "ext |");
+	for (k = 0; k < frags[i].n; k++)
+	    putchar(levels[(int)(frags[i].ext[k] * (nlevels - 1) + 0.5)]);
+	printf("%*s|\n", FRAG_SAMPLES - frags[i].n, "");
+    }
+}
+
+/*
+ * print_perf - Print the hardware events counted during one more 
+ *     timed replay of every trace, per request, followed by those of 
+ *     all traces. Events whose counters could not be opened are "-".
+ */
+static void print_perf(int n, double (*perf)[PERF_EVENTS], stats_t *stats)
+{
+    double total[PERF_EVENTS] = {0};
+    double ops = 0;
+    int i, k;
+
+    printf("Hardware events of mm malloc per request:\n");
+    printf("%5s%8s", "trace", "ops");
+    for (k = 0; k < PERF_EVENTS; k++)
+	printf("%9s", perf_name(k));
+    printf("\n");
+    for (i = 0; i <= n; i++) {
+	if (i < n && !stats[i].valid)
+	    continue;
+	if (i < n)
+	    printf("%2d%11.0f", i, stats[i].ops);
+	else
+	    printf("%5s%8.0f", "Total", ops);
+	for (k = 0; k < PERF_EVENTS; k++) {
+	    if (!perf_available(k))
+		printf("%9s", "-");
+	    else if (i < n)
+		printf("%9.2f", perf[i][k] / stats[i].ops);
+	    else
+		printf("%9.2f", total[k] / ops);
+	    if (i < n)
+		total[k] += perf[i][k];
+	}
+	if (i < n)
+	    ops += stats[i].ops;
+	printf("\n");
+    }
+}
+
+/*****************************************************************
+ * The following routines save the per-trace results of a run and 
+ * load them back, so that the throughput of two builds of mm.c 
+ * (e.g., mdriver-single and mdriver) can be compared trace by trace.
+ ****************************************************************/
+
+/*
+ * save_results - write one line "trace valid util ops secs" per trace
+ */
+static void save_results(char *filename, int n, char **tracefiles, 
+			 stats_t *stats)
+{
+    FILE *fp;
+    int i;
+
+    if ((fp = fopen(filename, "w")) == NULL) {
+	sprintf(msg, "Could not open %s in save_results", filename);
+	unix_error(msg);
+    }
+    for (i = 0; i < n; i++)
+	fprintf(fp, "%s %d %f %.0f %.9f\n", tracefiles[i], stats[i].valid,
+		stats[i].util, stats[i].ops, stats[i].secs);
+    fclose(fp);
+}
+
+/*
+ * load_results - read the results saved by save_results. Traces that 
+ *     are missing from the file are marked as not valid.
+ */
+static stats_t *load_results(char *filename, int n, char **tracefiles)
+{
+    FILE *fp;
+    stats_t *stats, s;
+    char name[MAXLINE];
+    char format[MAXLINE];
+    int i;
+
+    /* the names are read up to the size of name, like "%1023s" */
+    sprintf(format, "%%%ds %%d %%lf %%lf %%lf", MAXLINE - 1);
+    if ((stats = (stats_t *)calloc(n, sizeof(stats_t))) == NULL)
+	unix_error("calloc failed in load_results");
+    if ((fp = fopen(filename, "r")) == NULL) {
+	sprintf(msg, "Could not open %s in load_results", filename);
+	unix_error(msg);
+    }
+    while (fscanf(fp, format, name, &s.valid, &s.util, &s.ops, &s.secs) == 5) {
+	for (i = 0; i < n; i++)
+	    if (!strcmp(name, tracefiles[i]))
+		stats[i] = s;
+    }
+    fclose(fp);
+    return stats;
+}
+
 /*************************************
  * Some miscellaneous helper routines
  ************************************/
 
 
 /*
- * printresults - prints a performance summary for some malloc package
+ * printresults - prints a performance summary for some malloc package.
+ *     If base is not NULL, the throughput of each trace is also 
+ *     compared against the baseline run.
  */
-static void printresults(int n, stats_t *stats) 
+static void printresults(int n, stats_t *stats, stats_t *base) 
 {
     int i;
     double secs = 0;
     double ops = 0;
     double util = 0;
+    double ovhd = 0;
+    double hit = 0;
+    double copied = 0;
+    double rss = 0;
+    double base_secs = 0;
+    double base_ops = 0;
 
     /* Print the individual results for each trace */
-    printf("%5s%7s %5s%8s%10s%6s\n", 
-	   "trace", " valid", "util", "ops", "secs", "Kops");
+    printf("%5s%7s %5s%7s%6s%5s%7s%8s%10s%6s", 
+	   "trace", " valid", "util", "rssKB", "ovhd", "hit", "copyKB", "ops", "secs", "Kops");
+    if (base != NULL)
+	printf("%8s%7s", "base", "gain");
+    printf("\n");
     for (i=0; i < n; i++) {
 	if (stats[i].valid) {
-	    printf("%2d%10s%5.0f%%%8.0f%10.6f%6.0f\n", 
+	    printf("%2d%10s%5.0f%%%7.0f%6.1f%4.0f%%%7.0f%8.0f%10.6f%6.0f", 
 		   i,
 		   "yes",
 		   stats[i].util*100.0,
+		   stats[i].rss/1024,
+		   stats[i].ovhd,
+		   stats[i].hit*100.0,
+		   stats[i].copied/1024,
 		   stats[i].ops,
 		   stats[i].secs,
 		   (stats[i].ops/1e3)/stats[i].secs);
+	    if (base != NULL && base[i].valid) {
+		printf("%8.0f%6.2fx", 
+		       (base[i].ops/1e3)/base[i].secs,
+		       base[i].secs/stats[i].secs);
+		base_secs += base[i].secs;
+		base_ops += base[i].ops;
+	    }
+	    else if (base != NULL)
+		printf("%8s%7s", "-", "-");
+	    printf("\n");
 	    secs += stats[i].secs;
 	    ops += stats[i].ops;
 	    util += stats[i].util;
+	    ovhd += stats[i].ovhd;
+	    hit += stats[i].hit;
+	    copied += stats[i].copied;
+	    rss += stats[i].rss;
 	}
 	else {
-	    printf("%2d%10s%6s%8s%10s%6s\n", 
+	    printf("%2d%10s%6s%7s%6s%5s%7s%8s%10s%6s\n", 
 		   i,
 		   "no",
 		   "-",
 		   "-",
 		   "-",
+		   "-",
+		   "-",
+		   "-",
+		   "-",
 		   "-");
 	}
     }
 
     /* Print the aggregate results for the set of traces */
     if (errors == 0) {
-	printf("%12s%5.0f%%%8.0f%10.6f%6.0f\n", 
+	printf("%12s%5.0f%%%7.0f%6.1f%4.0f%%%7.0f%8.0f%10.6f%6.0f", 
 	       "Total       ",
 	       (util/n)*100.0,
+	       rss/1024,
+	       ovhd/n,
+	       (hit/n)*100.0,
+	       copied/1024,
 	       ops, 
 	       secs,
 	       (ops/1e3)/secs);
+	if (base != NULL && base_secs > 0)
+	    printf("%8.0f%6.2fx", 
+		   (base_ops/1e3)/base_secs,
+		   (ops/secs)/(base_ops/base_secs));
+	printf("\n");
     }
     else {
-	printf("%12s%6s%8s%10s%6s\n", 
+	printf("%12s%6s%7s%6s%5s%7s%8s%10s%6s\n", 
 	       "Total       ",
 	       "-", 
 	       "-", 
 	       "-", 
+	       "-", 
+	       "-", 
+	       "-", 
+	       "-", 
 	       "-");
     }
 
@@ -981,6 +2486,41 @@ void app_error(char *msg)
     exit(1);
 }
 
+/*
+ * take_snapshot - Replay a trace once more with the sampling profiler 
+ *     of mm.c on, and write a snapshot of the heap to 
+ *     <prefix><tracenum>.snap after the request at which the heap was 
+ *     largest in the replay of eval_mm_util, which is the same request 
+ *     of the same heap since the replay makes the same requests
+ */
+static void take_snapshot(trace_t *trace, int tracenum, range_t **ranges,
+			  snap_t *snap, char *prefix, size_t period)
+{
+    double ovhd, hit, copied, rss;
+
+    snprintf(snap->path, sizeof(snap->path), "%s%d.snap", prefix, tracenum);
+    snap->dump_op = snap->peak_op;
+    mm_set_sample_period(period);
+    eval_mm_util(trace, tracenum, ranges, &ovhd, &hit, &copied, &rss, NULL, snap);
+    mm_set_sample_period(0);
+    printf("Wrote a snapshot of the heap of trace %d after request %d to %s\n",
+	   tracenum, snap->dump_op, snap->path);
+}
+
+/*
+ * write_snapshot - Write a snapshot of the heap of mm.c to snap->path
+ */
+static void write_snapshot(snap_t *snap)
+{
+    int fd = open(snap->path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+    if (fd < 0)
+	unix_error("Could not open the snapshot file in write_snapshot");
+    if (mm_dump_snapshot(fd) < 0)
+	unix_error("mm_dump_snapshot failed in write_snapshot");
+    close(fd);
+}
+
 /* 
  * unix_error - Report a Unix-style error
  */
@@ -1004,14 +2544,25 @@ void malloc_error(int tracenum, int opnum, char *msg)
  */
 static void usage(void) 
 {
-    fprintf(stderr, "Usage: mdriver [-hvVal] [-f <file>] [-t <dir>]\n");
+    fprintf(stderr, "Usage: mdriver [-hvValLFCPU] [-f <file>] [-t <dir>] [-s <file>] [-b <file>] [-j <n>] [-x <pct>] [-d <prefix>] [-p <bytes>]\n");
     fprintf(stderr, "Options\n");
     fprintf(stderr, "\t-a         Don't check the team structure.\n");
+    fprintf(stderr, "\t-b <file>  Compare throughput against results saved by -s.\n");
+    fprintf(stderr, "\t-C         Check the whole heap after every request.\n");
+    fprintf(stderr, "\t-d <prefix> Write a snapshot of the heap at its peak in each trace to <prefix><n>.snap.\n");
     fprintf(stderr, "\t-f <file>  Use <file> as the trace file.\n");
+    fprintf(stderr, "\t-F         Plot the fragmentation of the heap over each trace.\n");
     fprintf(stderr, "\t-g         Generate summary info for autograder.\n");
     fprintf(stderr, "\t-h         Print this message.\n");
+    fprintf(stderr, "\t-j <n>     Replay each trace with up to <n> threads.\n");
     fprintf(stderr, "\t-l         Run libc malloc as well.\n");
+    fprintf(stderr, "\t-p <bytes> With -d, sample a payload every <bytes> allocated bytes (4096).\n");
+    fprintf(stderr, "\t-P         Count hardware events per request with perf_event_open.\n");
+    fprintf(stderr, "\t-L         Print percentiles of the latency of each request.\n");
+    fprintf(stderr, "\t-s <file>  Save the per-trace results to <file>.\n");
     fprintf(stderr, "\t-t <dir>   Directory to find default traces.\n");
+    fprintf(stderr, "\t-U         Make the batch requests with one mm_malloc or mm_free per block.\n");
     fprintf(stderr, "\t-v         Print per-trace performance breakdowns.\n");
     fprintf(stderr, "\t-V         Print additional debug info.\n");
+    fprintf(stderr, "\t-x <pct>   With -j, hand <pct>%% of the frees to another thread.\n");
 }
@@ -3,6 +3,7 @@
  *            allows us to interleave calls from the student's malloc package 
  *            with the system's malloc package in libc.
  */
+#define _GNU_SOURCE /* for mremap */
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
@@ -10,6 +11,7 @@
 #include <sys/mman.h>
 #include <string.h>
 #include <errno.h>
+#include <pthread.h>
 
 #include "memlib.h"
 #include "config.h"
@@ -18,20 +20,71 @@
 static char *mem_start_brk;  /* points to first byte of heap */
 static char *mem_brk;        /* points to last byte of heap */
 static char *mem_max_addr;   /* largest legal heap address */ 
+static char *mem_used_brk;   /* highest brk ever, no byte above it was written */
+static size_t mem_mapped;    /* bytes of the mappings made by mem_map */
+static size_t mem_peak;      /* largest heap size since the heap was last reset */
+static int mem_count_mapped = 1; /* whether mappings count in the heap size */
+
+/* the mappings made by mem_map, so that mem_in_heap can tell if a 
+   block lies in one of them */
+typedef struct {
+    char *start;
+    size_t size;
+} mapping_t;
+
+static mapping_t *mem_maps;
+static int mem_num_maps;
+static int mem_max_maps;
+static pthread_mutex_t mem_maps_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * find_mapping - return the index of the mapping starting at p, or 
+ *    mem_num_maps if there is none. mem_maps_lock must be held.
+ */
+static int find_mapping(char *p)
+{
+    int i;
+
+    for (i = 0; i < mem_num_maps; i++)
+	if (mem_maps[i].start == p)
+	    break;
+    return i;
+}
+
+/* 
+ * update_peak - record the current heap size if it is the largest yet
+ */
+static void update_peak(void)
+{
+    size_t size = mem_heapsize();
+    size_t peak = __atomic_load_n(&mem_peak, __ATOMIC_RELAXED);
+
+    while (size > peak &&
+	   !__atomic_compare_exchange_n(&mem_peak, &peak, size, 1,
+					__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+	;
+}
 
 /* 
  * mem_init - initialize the memory system model
  */
 void mem_init(void)
 {
-    /* allocate the storage we will use to model the available VM */
-    if ((mem_start_brk = (char *)malloc(MAX_HEAP)) == NULL) {
-	fprintf(stderr, "mem_init_vm: malloc error\n");
+    /* reserve the address space we will use to model the available VM;
+       pages only take physical memory once they are touched */
+    mem_start_brk = (char *)mmap(NULL, MAX_HEAP, PROT_READ | PROT_WRITE,
+				 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (mem_start_brk == MAP_FAILED) {
+	fprintf(stderr, "mem_init_vm: mmap error\n");
 	exit(1);
     }
 
     mem_max_addr = mem_start_brk + MAX_HEAP;  /* max legal heap address */
     mem_brk = mem_start_brk;                  /* heap is empty initially */
+    mem_used_brk = mem_start_brk;
+    mem_mapped = 0;
+    mem_peak = 0;
+    mem_num_maps = 0;
 }
 
 /* 
@@ -39,35 +92,173 @@ void mem_init(void)
  */
 void mem_deinit(void)
 {
-    free(mem_start_brk);
+    munmap(mem_start_brk, MAX_HEAP);
 }
 
 /*
- * mem_reset_brk - reset the simulated brk pointer to make an empty heap
+ * mem_reset_brk - reset the simulated brk pointer to make an empty heap.
+ *    The pages are kept, see mem_release.
  */
 void mem_reset_brk()
 {
     mem_brk = mem_start_brk;
+    mem_peak = 0;
+    update_peak();
 }
 
 /* 
  * mem_sbrk - simple model of the sbrk function. Extends the heap 
- *    by incr bytes and returns the start address of the new area. In
- *    this model, the heap cannot be shrunk.
+ *    by incr bytes and returns the start address of the new area. 
+ *    A negative incr shrinks the heap, and the whole pages it 
+ *    gives up are released.
  */
-void *mem_sbrk(int incr) 
+void *mem_sbrk(intptr_t incr) 
 {
     char *old_brk = mem_brk;
 
-    if ( (incr < 0) || ((mem_brk + incr) > mem_max_addr)) {
+    if (((mem_brk + incr) > mem_max_addr) || ((mem_brk + incr) < mem_start_brk)) {
 	errno = ENOMEM;
 	fprintf(stderr, "ERROR: mem_sbrk failed. Ran out of memory...\n");
 	return (void *)-1;
     }
     mem_brk += incr;
+    if (incr < 0)
+	mem_release(mem_brk, old_brk);
+    update_peak();
+    if (mem_brk > mem_used_brk)
+	__atomic_store_n(&mem_used_brk, mem_brk, __ATOMIC_RELAXED);
     return (void *)old_brk;
 }
 
+/*
+ * mem_release - give the whole pages between lo and hi back to the 
+ *    system with madvise(MADV_DONTNEED). They stay part of the heap 
+ *    and read as zeros the next time they are touched, so if they 
+ *    reach the bytes which were never written, those start at lo now.
+ */
+void mem_release(void *lo, void *hi)
+{
+    size_t pagesize = mem_pagesize();
+    char *start = (char *)(((size_t)lo + pagesize - 1) & ~(pagesize - 1));
+    char *end = (char *)((size_t)hi & ~(pagesize - 1));
+    char *untouched = (char *)mem_untouched();
+
+    if (start < end) {
+	madvise(start, end - start, MADV_DONTNEED);
+	if (end >= untouched && start < untouched)
+	    __atomic_store_n(&mem_used_brk, start, __ATOMIC_RELAXED);
+    }
+}
+
+/*
+ * mem_untouched - return the address from which no byte of the heap 
+ *    has been written, so that memory taken from there by mem_sbrk 
+ *    reads as zeros
+ */
+void *mem_untouched(void)
+{
+    return __atomic_load_n(&mem_used_brk, __ATOMIC_RELAXED);
+}
+
+/*
+ * mem_map - map size bytes outside of the heap, for blocks which are 
+ *    too large to be taken from it. Returns NULL on failure.
+ */
+void *mem_map(size_t size)
+{
+    void *p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (p == MAP_FAILED)
+	return NULL;
+
+    pthread_mutex_lock(&mem_maps_lock);
+    if (mem_num_maps == mem_max_maps) {
+	mapping_t *maps;
+	mem_max_maps = mem_max_maps ? 2 * mem_max_maps : 64;
+	if ((maps = realloc(mem_maps, mem_max_maps * sizeof(mapping_t))) == NULL) {
+	    fprintf(stderr, "mem_map: realloc error\n");
+	    exit(1);
+	}
+	mem_maps = maps;
+    }
+    mem_maps[mem_num_maps].start = p;
+    mem_maps[mem_num_maps].size = size;
+    mem_num_maps++;
+    pthread_mutex_unlock(&mem_maps_lock);
+
+    __atomic_add_fetch(&mem_mapped, size, __ATOMIC_RELAXED);
+    update_peak();
+    return p;
+}
+
+/*
+ * mem_unmap - unmap size bytes mapped by mem_map at p
+ */
+void mem_unmap(void *p, size_t size)
+{
+    pthread_mutex_lock(&mem_maps_lock);
+    mem_maps[find_mapping(p)] = mem_maps[--mem_num_maps];
+    pthread_mutex_unlock(&mem_maps_lock);
+
+    munmap(p, size);
+    __atomic_sub_fetch(&mem_mapped, size, __ATOMIC_RELAXED);
+}
+
+/*
+ * mem_remap - resize a mapping made by mem_map from old_size to 
+ *    new_size bytes, moving it if needed, which does not copy 
+ *    the pages. Returns the new address or NULL on failure.
+ */
+void *mem_remap(void *p, size_t old_size, size_t new_size)
+{
+    void *q = mremap(p, old_size, new_size, MREMAP_MAYMOVE);
+    int i;
+
+    if (q == MAP_FAILED)
+	return NULL;
+
+    pthread_mutex_lock(&mem_maps_lock);
+    i = find_mapping(p);
+    mem_maps[i].start = q;
+    mem_maps[i].size = new_size;
+    pthread_mutex_unlock(&mem_maps_lock);
+
+    if (new_size > old_size)
+	__atomic_add_fetch(&mem_mapped, new_size - old_size, __ATOMIC_RELAXED);
+    else
+	__atomic_sub_fetch(&mem_mapped, old_size - new_size, __ATOMIC_RELAXED);
+    update_peak();
+    return q;
+}
+
+/*
+ * mem_in_heap - check if the bytes from lo to hi (inclusive) lie in 
+ *    the heap or in one of the mappings made by mem_map
+ */
+int mem_in_heap(void *lo, void *hi)
+{
+    char *l = (char *)lo, *h = (char *)hi;
+    int i, found = 0;
+
+    if (l >= mem_start_brk && h < mem_brk)
+	return 1;
+    pthread_mutex_lock(&mem_maps_lock);
+    for (i = 0; i < mem_num_maps && !found; i++)
+	found = l >= mem_maps[i].start && h < mem_maps[i].start + mem_maps[i].size;
+    pthread_mutex_unlock(&mem_maps_lock);
+    return found;
+}
+
+/*
+ * mem_set_count_mapped - choose whether the mappings made by mem_map 
+ *    count in the heap size along with the brk heap (the default) 
+ */
+void mem_set_count_mapped(int on)
+{
+    mem_count_mapped = on;
+}
+
 /*
  * mem_heap_lo - return address of the first heap byte
  */
@@ -85,11 +276,51 @@ void *mem_heap_hi()
 }
 
 /*
- * mem_heapsize() - returns the heap size in bytes
+ * mem_heapsize() - returns the heap size in bytes, including the 
+ *    mappings made by mem_map unless mem_set_count_mapped(0) was called
  */
 size_t mem_heapsize() 
 {
-    return (size_t)(mem_brk - mem_start_brk);
+    size_t size = (size_t)(mem_brk - mem_start_brk);
+
+    if (mem_count_mapped)
+	size += __atomic_load_n(&mem_mapped, __ATOMIC_RELAXED);
+    return size;
+}
+
+/*
+ * mem_peak_heapsize() - returns the largest heap size in bytes since 
+ *    the heap was last reset
+ */
+size_t mem_peak_heapsize() 
+{
+    return mem_peak;
+}
+
+/*
+ * mem_rss() - returns the number of bytes of the heap model which are 
+ *    resident in physical memory. The mappings made by mem_map are 
+ *    counted as resident if they count in the heap size.
+ */
+size_t mem_rss()
+{
+    size_t pagesize = mem_pagesize();
+    size_t npages = (mem_used_brk - mem_start_brk + pagesize - 1) / pagesize;
+    size_t resident = 0;
+    size_t mapped = 0;
+    size_t i;
+    unsigned char *vec;
+
+    if (mem_count_mapped)
+	mapped = __atomic_load_n(&mem_mapped, __ATOMIC_RELAXED);
+    if (npages == 0 || (vec = (unsigned char *)malloc(npages)) == NULL)
+	return mapped;
+    if (mincore(mem_start_brk, npages * pagesize, vec) == 0) {
+	for (i = 0; i < npages; i++)
+	    resident += vec[i] & 1;
+    }
+    free(vec);
+    return resident * pagesize + mapped;
 }
 
 /*
@@ -1,11 +1,21 @@
 #include <unistd.h>
+#include <stdint.h>
 
 void mem_init(void);               
 void mem_deinit(void);
-void *mem_sbrk(int incr);
+void *mem_sbrk(intptr_t incr);
 void mem_reset_brk(void); 
 void *mem_heap_lo(void);
 void *mem_heap_hi(void);
 size_t mem_heapsize(void);
+size_t mem_peak_heapsize(void);
 size_t mem_pagesize(void);
+void mem_release(void *lo, void *hi);
+void *mem_untouched(void);
+void *mem_map(size_t size);
+void mem_unmap(void *p, size_t size);
+void *mem_remap(void *p, size_t old_size, size_t new_size);
+void mem_set_count_mapped(int on);
+int mem_in_heap(void *lo, void *hi);
+size_t mem_rss(void);
 
@@ -1,15 +1,81 @@
 /*
- * In this file, we implement malloc in terms of Explicit Free List.
- * Originally I plan to code the version of Seglist, but due to the time limit,
- * I decide to make some functions "degenerate".
- * However, the whole file is still written in the style of Seglist
- * and one can actually implement Seglist by extending some of the functions below.
+ * In this file, we implement malloc in terms of Segregated Free Lists.
+ * Free blocks smaller than SMALL_LIMIT are kept in lists whose ranges are SMALL_STEP bytes wide,
+ * and free blocks smaller than TREE_LIMIT are kept in lists whose ranges are powers of two.
+ * The list for a size is computed in O(1) by counting leading zeros, see find_index().
+ * Free blocks of at least TREE_LIMIT bytes are kept in a treap (a randomized balanced tree)
+ * ordered by size and address, so that the best fit among them is found in O(log n) expected time.
+ * Compiling with -DSINGLE_LIST gives back the degenerate case of a single explicit free list,
+ * which is useful as a baseline when measuring the throughput.
+ * Compiling with -DDEFERRED_COALESCING defers coalescing: a freed block goes on a quick list
+ * of its size class as it is, where a malloc of the same size takes it back, and the quick lists
+ * are only coalesced in bulk when a malloc finds no fit or too many blocks are waiting.
  *
- * Each node in the list consists of
+ * Payloads are aligned to 16 bytes and blocks are multiples of 16 bytes, but the overhead blocks
+ * are 4-byte words, so a block starts 4 bytes before its payload. Each node in the list consists of
  * top: record the size of the block, the last bit is used to determine if it is free
- * next: store the starting address of the next node in the list, null if there is no next node
- * prev: store the starting address of the previous node in the list, null if it is the first node
+ *      and the second last bit is used to determine if the previous block is allocated
+ * next: store the offset of the next node in the list from the start of the heap, 0 if there is no next node
+ * prev: store the offset of the previous node in the list, 0 if it is the first node
  * bottom: record the size of the block, the last bit is used to determine if it is free
+ * A node in the tree uses next and prev as the offsets of its left and right children instead,
+ * and the block after prev stores the offset of its parent.
+ * Since the heap never grows beyond 4GB, offsets and sizes fit in a word, and the smallest block
+ * is 16 bytes, as on a 32-bit machine.
+ *
+ * An allocated block only has the top overhead block, and its payload extends to the end of the block.
+ * The bottom is only needed when the previous block is free, which is told by the bit in the top.
+ *
+ * The package is thread-safe. The lists and the tree belong to an arena, and every thread
+ * allocates from the arena it is assigned to when it first calls malloc, under the lock of that arena.
+ * There is one arena unless mm_set_arenas() asks for more before mm_init().
+ * The memory of an arena is a list of segments, each of which starts with the address
+ * of the previous segment and ends with an epilogue, a top overhead block of size 0 which is never free.
+ * A segment grows at the end of the heap as long as no other arena has taken memory after it,
+ * otherwise a new segment is started. With several arenas, segments are made of whole chunks,
+ * so that the arena owning a block is found from its address in chunk_owner.
+ * A block freed by a thread of another arena is pushed onto a lock-free stack of its owner,
+ * which frees it the next time it takes its lock.
+ *
+ * Payloads of at most SLAB_LIMIT bytes are not given blocks. They are slots in slab pages instead,
+ * which are SLAB_PAGE bytes aligned to SLAB_PAGE and allocated as ordinary blocks of the arena.
+ * A page only holds slots of one size, which have no overheads; the slots in use are marked
+ * in a bitmap in the header of the page, and the page of a slot is found by masking its address.
+ * Whether an address is in a slab page is recorded in slab_map, one bit for every page of the heap.
+ * Each arena keeps a list of its pages with free slots for every slot size.
+ *
+ * In front of the arena, every thread has a cache of small blocks with a bin for each block size
+ * below TCACHE_LIMIT and for every slot size. A small block freed by the thread is pushed onto its bin and stays allocated
+ * as far as the arena knows, so that the next malloc of that size pops it without taking the lock
+ * or touching the lists. A bin holds at most TCACHE_DEPTH blocks, and it is flushed back
+ * to the arena when one more block is freed.
+ *
+ * Freeing a block which leaves a large free block gives its memory back to the system:
+ * the end of the heap is trimmed with a negative mem_sbrk when the free block is the last one,
+ * otherwise the pages inside it which have just become free are released with mem_release, see give_back().
+ *
+ * Payloads of at least MMAP_THRESHOLD bytes do not come from the heap at all. Each of them gets
+ * a mapping of its own from mem_map, with a header linking it into a list of such blocks.
+ * Freeing one unmaps it, and reallocating one resizes its mapping with mem_remap.
+ *
+ * mm_malloc_batch() takes the blocks of a batch of payloads of the same size out of a single free block,
+ * or out of the memory mem_sbrk adds at the end of the heap, which is found once and cut into blocks in a single pass.
+ * mm_free_batch() sorts the payloads it frees by address, so that every run of adjacent blocks among them
+ * is merged into one block and coalesced with its neighbours once.
+ *
+ * Every arena counts its free blocks by size class as they enter and leave the lists and the tree,
+ * and how many blocks its searches look at, so that mm_stats() reports the fragmentation of the heap
+ * without walking it. Blocks waiting on the quick lists or in the caches of the threads are not free in this sense.
+ *
+ * The sampling profiler, which mm_set_sample_period() turns on, records the payload every sample_period-th
+ * allocated byte falls in, with its size and the site set by mm_set_site(), in a table of the sampled payloads
+ * which mm_free() takes it out of. Every thread counts down the bytes to its next sample, so that a malloc
+ * which is not sampled only costs a subtraction, see count_sample(). mm_dump_snapshot() walks every segment
+ * under the locks of all arenas and writes the blocks and the sampled payloads in the format of heapsnap.h.
+ *
+ * mm_check() checks the consistency of the heap. Every thread remembers the block its last request
+ * ended in, so that the incremental mode only checks that block and its neighbours, while the full mode
+ * walks every segment and checks that the lists and the tree hold exactly the free blocks.
  */
 
 #include <stdio.h>
@@ -17,9 +83,12 @@
 #include <assert.h>
 #include <unistd.h>
 #include <string.h>
+#include <sched.h>
+#include <pthread.h>
 
 #include "mm.h"
 #include "memlib.h"
+#include "heapsnap.h"
 
 team_t team = {
     /* Team name */
@@ -34,282 +103,1639 @@ team_t team = {
     ""
 };
 
-/* single word (4) or double word (8) alignment */
-#define ALIGNMENT 8
+/* payloads are aligned to 16 bytes, like those of the malloc of x86-64 */
+#define ALIGNMENT 16
 
 /* rounds up to the nearest multiple of ALIGNMENT */
-#define ALIGN(size) (((size) + (ALIGNMENT-1)) & ~0x7)
+#define ALIGN(size) (((size) + (ALIGNMENT-1)) & ~(size_t)(ALIGNMENT-1))
+
+// the overhead blocks are 4-byte words, so a block starts 4 bytes before an aligned payload
+typedef unsigned int word_t;
+#define WSIZE ((size_t) sizeof(word_t))
 
+// the links of the lists and the tree are offsets of the nodes from the start of the heap,
+// which fit in a word since the heap never grows beyond HEAP_LIMIT; 0 stands for no node,
+// since the arenas are at the start of the heap
+#define TO_OFFSET(p) ((p) == NULL ? 0 : (word_t)(((char *) (p)) - heap_lo))
+#define TO_NODE(o) ((o) == 0 ? NULL : (word_t *)(heap_lo + (o)))
+
+// the k-th word of the block starting at p
+#define WORD(p, k) (((word_t *) (p))[k])
 
-#define SIZE_T_SIZE (ALIGN(sizeof(size_t)))
 // find the starting address of the next node in the list
-#define NEXT_NODE_ADDRESS(p) ((size_t *)*(size_t *)(((char *) p) + SIZE_T_SIZE))
+#define NEXT_NODE_ADDRESS(p) TO_NODE(WORD(p, 1))
 
 // find the starting address of the previous node in the list
-#define PREV_NODE_ADDRESS(p) ((size_t *)*(size_t *)(((char *) p) + 2 * SIZE_T_SIZE))
+#define PREV_NODE_ADDRESS(p) TO_NODE(WORD(p, 2))
+
+// store the starting address of the next node in the list
+#define SET_NEXT_NODE(p, q) (WORD(p, 1) = TO_OFFSET(q))
+
+// store the starting address of the previous node in the list
+#define SET_PREV_NODE(p, q) (WORD(p, 2) = TO_OFFSET(q))
 
-// find the place where the starting address of the next node is stored
-#define NEXT_NODE_OH(p) (*(size_t **)(((char *) p) + SIZE_T_SIZE))
+// bits stored together with the size in the top and bottom overhead blocks
+#define FREE_BIT 1
+#define PREV_ALLOC_BIT 2
 
-// find the place where the starting address of the previous node is stored
-#define PREV_NODE_OH(p) (*(size_t **)(((char *) p) + 2 * SIZE_T_SIZE))
+// the size of the block starting at p
+#define GET_SIZE(p) (*(word_t *)(p) & ~(word_t)(ALIGNMENT - 1))
+
+// check if the block before the block starting at p is allocated
+#define IS_PREV_ALLOC(p) (*(word_t *)(p) & PREV_ALLOC_BIT)
+
+// find the starting address of the block after the block starting at p
+#define NEXT_BLOCK(p) ((word_t *)(((char *) p) + GET_SIZE(p)))
+
+// find the starting address of the block before the block starting at p, which must be free
+#define PREV_BLOCK(p) ((word_t *)(((char *) p) - GET_SIZE(((char *) p) - WSIZE)))
 
 // find the head of the list of index i (the free list whose nodes are of size in the i-th range)
-#define GET_HEAD(i) ((size_t *)*(size_t *)(mem_heap_lo() + i * SIZE_T_SIZE))
+#define GET_HEAD(a, i) ((a)->heads[i])
+
+// find the place where the root of the tree is stored
+#define TREE_ROOT(a) ((a)->root)
 
-// number of overhead blocks for free blocks
+// find the children and the parent of a node in the tree, and store them
+#define LEFT_CHILD(p) NEXT_NODE_ADDRESS(p)
+#define RIGHT_CHILD(p) PREV_NODE_ADDRESS(p)
+#define PARENT(p) TO_NODE(WORD(p, 3))
+#define SET_LEFT_CHILD(p, q) SET_NEXT_NODE(p, q)
+#define SET_RIGHT_CHILD(p, q) SET_PREV_NODE(p, q)
+#define SET_PARENT(p, q) (WORD(p, 3) = TO_OFFSET(q))
+
+// number of overhead blocks for free blocks in the lists, nodes in the tree have one more
 #define FREE_OVERHEAD_BLOCKS 4
 
 // number of overhead blocks for allocated blocks
-#define ALLOCATED_OVERHEAD_BLOCKS 2
+#define ALLOCATED_OVERHEAD_BLOCKS 1
+
+// the number of bytes at the start of the payload which are overwritten by the links once it is freed
+#define LINK_BYTES ((FREE_OVERHEAD_BLOCKS - 1) * WSIZE)
+
+// the minimum size of a block, which must be able to store the overheads once it is freed
+#define MIN_BLOCK_SIZE ALIGN(FREE_OVERHEAD_BLOCKS * WSIZE)
 
-// number of free lists, we are considering the degenerated case (a single explicit free list)
+// a segment starts with the address of the previous one, followed by padding which makes
+// the payload of its first block aligned, and ends with the epilogue
+#define SEGMENT_HEAD (ALIGNMENT - WSIZE)
+#define SEGMENT_OVERHEAD (SEGMENT_HEAD + WSIZE)
+
+// blocks smaller than SMALL_LIMIT go to lists whose ranges are SMALL_STEP bytes wide
+#define SMALL_LIMIT_LOG 8
+#define SMALL_LIMIT (1 << SMALL_LIMIT_LOG)
+#define SMALL_STEP_LOG 4
+
+// blocks of at least TREE_LIMIT go to the tree
+#define TREE_LIMIT_LOG 10
+#define TREE_LIMIT (1 << TREE_LIMIT_LOG)
+
+// number of lists for small blocks
+#define SMALL_LISTS ((SMALL_LIMIT - MIN_BLOCK_SIZE) >> SMALL_STEP_LOG)
+
+// number of free lists, the tree is treated as one more list of index SEGLIST_BLOCKS
+#ifdef SINGLE_LIST
 #define SEGLIST_BLOCKS 1
+#else
+#define SEGLIST_BLOCKS (SMALL_LISTS + TREE_LIMIT_LOG - SMALL_LIMIT_LOG)
+#endif
+
+// floor(log2(x)) for a nonzero x, computed by counting leading zeros
+#define LOG2(x) (8 * sizeof(unsigned long) - 1 - __builtin_clzl(x))
+
+// the maximum number of arenas
+#define MAX_ARENAS 64
+
+// with several arenas, the heap is handed out in chunks of CHUNK_SIZE bytes
+// the owners of the first MAX_CHUNKS chunks are recorded, which covers 4GB
+#define CHUNK_LOG 16
+#define CHUNK_SIZE (1 << CHUNK_LOG)
+#define MAX_CHUNKS (1 << 16)
+
+// the heap never grows beyond 4GB, so that offsets from its start and block sizes fit in a word
+#define HEAP_LIMIT ((size_t) MAX_CHUNKS << CHUNK_LOG)
+
+// round a number of bytes taken from mem_sbrk up to whole chunks when there are several arenas
+#define ROUND_CHUNK(n) (num_arenas > 1 ? ((n) + CHUNK_SIZE - 1) & ~(size_t)(CHUNK_SIZE - 1) : (n))
+
+// payloads of at most SLAB_LIMIT bytes are slots in slab pages of SLAB_PAGE bytes
+// there is a slot size for every multiple of ALIGNMENT up to SLAB_LIMIT
+#define SLAB_LIMIT 64
+#define SLAB_PAGE_LOG 10
+#define SLAB_PAGE (1 << SLAB_PAGE_LOG)
+#define SLAB_CLASSES (SLAB_LIMIT / ALIGNMENT)
+#define SLAB_CLASS(size) ((size) == 0 ? 0 : (ALIGN(size) / ALIGNMENT - 1))
+
+// the number of words in the bitmap of a page, which has a bit for every slot
+#define SLAB_MAP_WORDS ((SLAB_PAGE / ALIGNMENT + 63) / 64)
+
+// when freeing a block leaves a free block of at least TRIM_THRESHOLD bytes, its memory
+// is given back to the system, except for TRIM_PAD bytes at the end of the heap
+// when the heap grows again after being trimmed, the threshold rises to twice the bytes trimmed,
+// up to TRIM_THRESHOLD_MAX, so that memory is not given back only to be taken again;
+// mm_init() starts it over, so that every heap is trimmed the same way whatever heaps came before
+#define TRIM_THRESHOLD (128 * 1024)
+#define TRIM_THRESHOLD_MAX (64 * 1024 * 1024)
+#define TRIM_PAD (64 * 1024)
+
+// payloads of at least MMAP_THRESHOLD bytes are given mappings of their own outside the heap
+// unless mm_set_mmap_threshold() sets another threshold, the threshold rises to the size of
+// a freed block with a mapping of its own up to MMAP_THRESHOLD_MAX, so that a program which
+// keeps allocating and freeing such blocks gets them from the heap instead
+#define MMAP_THRESHOLD (128 * 1024)
+#define MMAP_THRESHOLD_MAX (32 * 1024 * 1024)
+
+// when compiled with -DDEFERRED_COALESCING, freed blocks are put on quick lists instead,
+// and they are coalesced when a malloc finds no fit or when there are QUICK_LIMIT of them
+#define QUICK_LIMIT 64
+
+// mm_malloc_batch() carves the blocks of a batch out of single blocks of at most BATCH_LIMIT bytes,
+// so that a large batch still fits in the free blocks of the heap
+#define BATCH_LIMIT (64 * 1024)
+
+// the number of pages of the heap recorded in slab_map, which covers 4GB
+#define MAX_SLAB_PAGES (1 << (32 - SLAB_PAGE_LOG))
+
+// the header at the start of a slab page, which is followed by the slots
+typedef struct slab {
+    struct slab *next;              // next page of the same slot size with free slots
+    struct slab *prev;              // previous page of the same slot size with free slots
+    unsigned int size;              // size of the slots
+    unsigned int used;              // number of slots in use
+    unsigned int slots;             // number of slots
+    unsigned int cls;               // index of the slot size
+    unsigned long long map[SLAB_MAP_WORDS]; // the k-th bit is set if the k-th slot is in use
+} slab_t;
+
+#define SLAB_HEADER ALIGN(sizeof(slab_t))
+
+// find the header of the slab page containing the address p
+#define SLAB_OF(p) ((slab_t *)((size_t)(p) & ~(size_t)(SLAB_PAGE - 1)))
+
+// an arena is a set of free lists and a tree, together with the memory they are taken from
+// the arenas are stored at the start of the heap
+typedef struct {
+    word_t *heads[SEGLIST_BLOCKS];  // heads of the free lists
+    word_t *root;                   // root of the tree
+    // the i-th bit is set if and only if the i-th free list is not empty
+    // and the bit of index SEGLIST_BLOCKS is set if and only if the tree is not empty
+    unsigned int nonempty;
+    word_t *last;                   // epilogue of the newest segment, NULL if there is none
+    void **segments;                // the newest segment, which stores the address of the previous one
+    slab_t *slabs[SLAB_CLASSES];    // pages with free slots for each slot size
+    mm_stats_t stats;               // counters reported by mm_stats()
+    void *remote;                   // blocks freed by other threads, linked through their payloads
+    int lock;                       // held while the lists, the tree or the segments are used
+#ifdef DEFERRED_COALESCING
+    void *quick[SEGLIST_BLOCKS + 1];// freed blocks not coalesced yet, for each size class
+    unsigned int deferred;          // the number of blocks on the quick lists
+#endif
+} arena_t;
+
+// the header of a block with a mapping of its own, before its payload
+// all such blocks are linked in a list, so that mm_init() can unmap those of the previous heap
+typedef struct mapped {
+    struct mapped *next;
+    struct mapped *prev;
+    size_t size;                    // the length of the mapping
+} mapped_t;
+
+#define MAPPED_HEADER ALIGN(sizeof(mapped_t))
+#define MAPPED_OF(p) ((mapped_t *)(((char *)(p)) - MAPPED_HEADER))
+
+// the list of blocks with mappings of their own, and their number and total size,
+// which are changed under map_lock
+static mapped_t *mapped;
+static size_t mapped_blocks;
+static size_t mapped_bytes;
+static int map_lock;
+
+// the current threshold, which mm_init() starts over unless it was set by mm_set_mmap_threshold(),
+// and which is only changed under map_lock, and whether it was set that way
+static size_t mmap_threshold = MMAP_THRESHOLD;
+static int mmap_threshold_fixed;
+
+// the arenas, their number, and the number of arenas for the next mm_init()
+static arena_t *arenas;
+static int num_arenas;
+static int requested_arenas = 1;
+
+// incremented by mm_init(), so that threads know their arena is from an old heap
+static unsigned int heap_gen;
+
+// the arena the next new thread is assigned to, modulo num_arenas
+static unsigned int next_arena;
+
+// blocks smaller than TCACHE_LIMIT are cached by the threads, with a bin for each size
+// and one more bin for each slot size after them, and at most TCACHE_DEPTH blocks in a bin
+#define TCACHE_LIMIT 256
+#define TCACHE_DEPTH 16
+#define TCACHE_BLOCK_BINS ((TCACHE_LIMIT - MIN_BLOCK_SIZE) / ALIGNMENT)
+#define TCACHE_BINS (TCACHE_BLOCK_BINS + SLAB_CLASSES)
+#define TCACHE_INDEX(size) (((size) - MIN_BLOCK_SIZE) / ALIGNMENT)
+#define TCACHE_SIZE(i) ((i) < TCACHE_BLOCK_BINS ? MIN_BLOCK_SIZE + (i) * ALIGNMENT \
+                                                : ((i) - TCACHE_BLOCK_BINS + 1) * ALIGNMENT)
+
+// the arena of a thread and its cache of small blocks, valid if gen is heap_gen
+// each bin is a stack linked through the first word of the payloads
+typedef struct {
+    arena_t *arena;
+    unsigned int gen;
+    void *bins[TCACHE_BINS];
+    unsigned int counts[TCACHE_BINS];
+    size_t hits;                    // mallocs served by the cache, not yet added to the arena
+    size_t misses;                  // mallocs of cached sizes which were not
+    size_t copied;                  // bytes copied by reallocs, not yet added to the arena
+    void *touched;                  // the payload the last request ended in, for mm_check()
+    char *fresh;                    // where the bytes the thread last took from mem_sbrk which had
+                                    // never been written start, for mm_calloc()
+    size_t sample_left;             // bytes the thread allocates before its next sample
+    unsigned int site;              // the site of its requests, set by mm_set_site()
+} tcache_t;
+
+static __thread tcache_t tcache;
+
+// the key whose destructor flushes the cache of a thread when it exits
+static pthread_key_t tcache_key;
+static pthread_once_t tcache_once = PTHREAD_ONCE_INIT;
+
+// held while mem_sbrk is called, since several arenas may grow at the same time
+static int sbrk_lock;
+
+// the current threshold, and the bytes trimmed since the heap last grew, changed under sbrk_lock
+static size_t trim_threshold = TRIM_THRESHOLD;
+static size_t trimmed;
+
+// the index of the arena owning each chunk of the heap, used when there are several arenas
+static unsigned char chunk_owner[MAX_CHUNKS];
+
+// the bit of a page of the heap is set if it is a slab page, counting from the page of mem_heap_lo()
+// a byte covers pages of a single chunk, so only the owner of that chunk changes it
+// slab_map_size is the number of bytes which may have been set since mm_init()
+static unsigned char slab_map[MAX_SLAB_PAGES / 8];
+static size_t slab_map_size;
+
+// the start of the heap, as returned by mem_heap_lo()
+static char *heap_lo;
+
+// the payloads recorded by the sampling profiler, in a hash table with linear probing on their addresses,
+// which is changed under sample_lock and never holds more than 3/4 of SAMPLE_SLOTS
+#define SAMPLE_SLOTS (1 << 15)
+#define SAMPLE_HASH(p) ((unsigned int)((size_t)(p) >> 4) * 2654435761u % SAMPLE_SLOTS)
+
+// while the profiler is off, a thread looks whether it was turned on once every SAMPLE_POLL bytes it allocates
+#define SAMPLE_POLL (1 << 20)
+
+typedef struct {
+    void *ptr;                      // the payload, NULL if the slot is empty
+    unsigned int size;              // bytes requested
+    unsigned int site;              // the site of the request which allocated it
+    unsigned int hits;              // the number of sampled bytes in it
+} sample_t;
+
+static sample_t samples[SAMPLE_SLOTS];
+static size_t num_samples;
+static size_t sample_period;
+static int sample_lock;
+
 
-// when nonzero, this records the size of the largest block in the current free list
-// and this is used to avoid repeated computations in some test cases
-static size_t curr_max;
+/*
+ * mm_set_arenas - set the number of arenas used after the next call to mm_init
+ */
+void mm_set_arenas(int n)
+{
+    if (n < 1)
+        n = 1;
+    if (n > MAX_ARENAS)
+        n = MAX_ARENAS;
+    requested_arenas = n;
+}
 
+/*
+ * mm_set_mmap_threshold - set the payload size from which blocks are given mappings of their own,
+ * a size of 0 turns them off
+ */
+void mm_set_mmap_threshold(size_t size)
+{
+    mmap_threshold = size == 0 ? (size_t) -1 : size;
+    mmap_threshold_fixed = 1;
+}
 
-/* 
+/*
  * mm_init - initialize the malloc package.
  */
 int mm_init(void)
 {
-    curr_max = 0;
-    // initialize the heads for each free list
-    // one more block is used to separate heads and the actual lists
-    void *p = mem_sbrk((SEGLIST_BLOCKS + 1) * SIZE_T_SIZE);
+    num_arenas = requested_arenas;
+    // the arenas are placed at the start of the heap
+    // with several arenas they take whole chunks, so that every segment starts at a chunk
+    size_t size = ROUND_CHUNK(ALIGN(num_arenas * sizeof(arena_t)));
+    void *p = mem_sbrk(size);
     if (p == (void *) -1) {
         printf("Unable to initialize\n");
         return -1;
     }
-    // make them zero to start with empty lists
-    memset(p, 0, (SEGLIST_BLOCKS + 1) * SIZE_T_SIZE);
+    // make them zero to start with empty lists, empty trees and no segments
+    memset(p, 0, size);
+    arenas = p;
+    heap_lo = mem_heap_lo();
+    trim_threshold = TRIM_THRESHOLD;
+    trimmed = 0;
+    memset(slab_map, 0, slab_map_size);
+    slab_map_size = 0;
+    // the blocks with mappings of their own which were not freed belong to the previous heap
+    while (mapped != NULL) {
+        mapped_t *m = mapped;
+        mapped = m->next;
+        mem_unmap(m, m->size);
+    }
+    mapped_blocks = 0;
+    mapped_bytes = 0;
+    if (!mmap_threshold_fixed)
+        mmap_threshold = MMAP_THRESHOLD;
+    // so were the sampled payloads
+    if (num_samples != 0) {
+        memset(samples, 0, sizeof(samples));
+        num_samples = 0;
+    }
+    next_arena = 0;
+    heap_gen++;
     return 0;
 }
 
 
+// take a test-and-set lock, which costs much less than a mutex when it is free
+// a thread waiting for it yields the processor, since the holder may have been preempted
+static void lock(int *l) {
+    while (__atomic_exchange_n(l, 1, __ATOMIC_ACQUIRE))
+        while (__atomic_load_n(l, __ATOMIC_RELAXED))
+            sched_yield();
+}
+
+static void unlock(int *l) {
+    __atomic_store_n(l, 0, __ATOMIC_RELEASE);
+}
+
+static void flush_tcache(void *unused);
+
+static void make_tcache_key(void) {
+    pthread_key_create(&tcache_key, flush_tcache);
+}
+
+// find the arena of the current thread, assigning one in a round-robin manner at its first call
+// the cache of the thread is emptied at the same time, since its blocks are from an old heap
+static arena_t *current_arena(void) {
+    if (tcache.gen != heap_gen) {
+        memset(&tcache, 0, sizeof(tcache));
+        tcache.arena = &arenas[__atomic_fetch_add(&next_arena, 1, __ATOMIC_RELAXED) % num_arenas];
+        tcache.gen = heap_gen;
+        pthread_once(&tcache_once, make_tcache_key);
+        pthread_setspecific(tcache_key, &tcache);
+    }
+    return tcache.arena;
+}
+
+// find the arena owning the block whose payload starts at ptr
+static arena_t *owner(void *ptr) {
+    if (num_arenas == 1)
+        return arenas;
+    return &arenas[chunk_owner[((char *) ptr - heap_lo) >> CHUNK_LOG]];
+}
+
+// the index in slab_map of the page containing the address p
+#define SLAB_INDEX(p) (((size_t)(p) >> SLAB_PAGE_LOG) - ((size_t) heap_lo >> SLAB_PAGE_LOG))
+
+// check if the payload at ptr is a slot in a slab page rather than a block
+static int is_slab(void *ptr) {
+    size_t i = SLAB_INDEX(ptr);
+    return (slab_map[i >> 3] >> (i & 7)) & 1;
+}
+
 // check if a block is free by checking the last bit in the top and tail overhead blocks
-static int is_free(size_t *p) {
+static int is_free(word_t *p) {
     if (p == NULL)
         return 0;
-    return (*p) & 1 ;
+    return (*p) & FREE_BIT;
 }
 
-// print all elements in the heap
+// find the size of the largest free block of the arena, whose lock is held
+// this is the rightmost node of the tree, or otherwise the largest node in the last non-empty list
+static size_t largest_free(arena_t *a) {
+    word_t *p = TREE_ROOT(a);
+    size_t largest = 0;
+    if (p != NULL) {
+        while (RIGHT_CHILD(p) != NULL)
+            p = RIGHT_CHILD(p);
+        return GET_SIZE(p);
+    }
+    if (a->nonempty == 0)
+        return 0;
+    for (p = GET_HEAD(a, LOG2(a->nonempty)); p != NULL; p = NEXT_NODE_ADDRESS(p))
+        if (GET_SIZE(p) > largest)
+            largest = GET_SIZE(p);
+    return largest;
+}
+
+/*
+ * mm_stats - report the number of allocated blocks and their total size including overheads,
+ * how many small mallocs have been served by the caches of the threads and how much reallocs copied,
+ * how the free blocks are spread over the size classes and how long the searches for a fit were
+ */
+void mm_stats(mm_stats_t *st)
+{
+    memset(st, 0, sizeof(*st));
+    for (int i = 0; i < num_arenas; i++) {
+        arena_t *a = &arenas[i];
+        lock(&a->lock);
+        st->alloc_blocks += a->stats.alloc_blocks;
+        st->alloc_bytes += a->stats.alloc_bytes;
+        st->tcache_hits += a->stats.tcache_hits;
+        st->tcache_misses += a->stats.tcache_misses;
+        st->realloc_copied += a->stats.realloc_copied;
+        st->free_blocks += a->stats.free_blocks;
+        st->free_bytes += a->stats.free_bytes;
+        for (int k = 0; k < MM_FREE_CLASSES; k++)
+            st->free_class_bytes[k] += a->stats.free_class_bytes[k];
+        size_t largest = largest_free(a);
+        if (largest > st->largest_free)
+            st->largest_free = largest;
+        st->searches += a->stats.searches;
+        st->search_steps += a->stats.search_steps;
+        unlock(&a->lock);
+    }
+    if (st->free_bytes != 0)
+        st->ext_frag = 1.0 - (double) st->largest_free / st->free_bytes;
+    lock(&map_lock);
+    st->alloc_blocks += mapped_blocks;
+    st->alloc_bytes += mapped_bytes;
+    unlock(&map_lock);
+    // the blocks in the cache of this thread are allocated as far as its arena knows
+    // while those cached by other threads cannot be seen here
+    if (tcache.gen == heap_gen) {
+        st->tcache_hits += tcache.hits;
+        st->tcache_misses += tcache.misses;
+        st->realloc_copied += tcache.copied;
+        for (int i = 0; i < TCACHE_BINS; i++) {
+            st->alloc_blocks -= tcache.counts[i];
+            st->alloc_bytes -= tcache.counts[i] * TCACHE_SIZE(i);
+        }
+    }
+}
+
+// print all elements in the heap, arena by arena and segment by segment from the newest one
 // each line represents either a free block or an allocated block
 void display_list() {
-    char *p = ((char *)mem_heap_lo()) + (SEGLIST_BLOCKS + 1) * SIZE_T_SIZE;
     printf("Start of list \n");
-    while (p != mem_heap_hi() + 1) {
-        if (is_free((size_t *)p)) {
-            printf("A free block of size %d \n", (*(size_t *)p) - 1);
-            p += (*(size_t *)p) - 1;
-        } else {
-            printf("An allocated block of size %d \n", (*(size_t *)p));
-            p += (*(size_t *)p);
+    for (int i = 0; i < num_arenas; i++) {
+        for (void **seg = arenas[i].segments; seg != NULL; seg = *seg) {
+            printf("A segment of arena %d \n", i);
+            word_t *p = (word_t *)(((char *) seg) + SEGMENT_HEAD);
+            while (GET_SIZE(p) != 0) {
+                if (is_free(p)) {
+                    printf("A free block of size %d \n", (int)GET_SIZE(p));
+                } else {
+                    printf("An allocated block of size %d%s \n", (int)GET_SIZE(p),
+                           IS_PREV_ALLOC(p) ? "" : " after a free block");
+                }
+                p = NEXT_BLOCK(p);
+            }
         }
     }
     printf("End of list \n");
 }
 
-// find the corresponding list for the size
-// one can implement Seglist by extending this function according to its range of sizes
+// find the corresponding list for the size, which is SEGLIST_BLOCKS for the tree
+// small sizes are mapped linearly, and larger sizes are mapped by their highest set bit
 static size_t find_index(size_t size) {
-
+#ifdef SINGLE_LIST
     return 0;
+#else
+    if (size < SMALL_LIMIT)
+        return (size - MIN_BLOCK_SIZE) >> SMALL_STEP_LOG;
+    if (size >= TREE_LIMIT)
+        return SEGLIST_BLOCKS;
+    return SMALL_LISTS + LOG2(size) - SMALL_LIMIT_LOG;
+#endif
+}
+
+// compare the key (size, addr) with the key of a node in the tree
+// nodes are ordered by size first and then by address, so that every node has a distinct key
+static int compare(size_t size, word_t *addr, word_t *node) {
+    if (size != GET_SIZE(node))
+        return size < GET_SIZE(node) ? -1 : 1;
+    return addr < node ? -1 : addr > node;
+}
+
+// the priority of a node in the tree, which is a hash of its address
+// the tree is a treap: it is ordered by keys and every parent has a priority no less than its children
+#define PRIORITY(p) ((unsigned int)((size_t)(p) >> 3) * 2654435761u)
+
+// make c take the place of the child p of parent, where a NULL parent means p is the root
+static void replace_child(arena_t *a, word_t *parent, word_t *p, word_t *c) {
+    if (parent == NULL)
+        TREE_ROOT(a) = c;
+    else if (LEFT_CHILD(parent) == p)
+        SET_LEFT_CHILD(parent, c);
+    else
+        SET_RIGHT_CHILD(parent, c);
+}
+
+// rotate the left child of p up to the place of p
+static void rotate_right(arena_t *a, word_t *p) {
+    word_t *y = LEFT_CHILD(p);
+    word_t *c = RIGHT_CHILD(y);
+    SET_LEFT_CHILD(p, c);
+    if (c != NULL)
+        SET_PARENT(c, p);
+    SET_PARENT(y, PARENT(p));
+    replace_child(a, PARENT(p), p, y);
+    SET_RIGHT_CHILD(y, p);
+    SET_PARENT(p, y);
+}
+
+// rotate the right child of p up to the place of p
+static void rotate_left(arena_t *a, word_t *p) {
+    word_t *y = RIGHT_CHILD(p);
+    word_t *c = LEFT_CHILD(y);
+    SET_RIGHT_CHILD(p, c);
+    if (c != NULL)
+        SET_PARENT(c, p);
+    SET_PARENT(y, PARENT(p));
+    replace_child(a, PARENT(p), p, y);
+    SET_LEFT_CHILD(y, p);
+    SET_PARENT(p, y);
+}
+
+// add a node to the tree as a leaf and then rotate it up according to its priority
+static void add_to_tree(arena_t *a, word_t *p, size_t size) {
+    word_t *parent = NULL;
+    word_t *t = TREE_ROOT(a);
+    while (t != NULL) {
+        parent = t;
+        t = compare(size, p, t) < 0 ? LEFT_CHILD(t) : RIGHT_CHILD(t);
+    }
+    SET_LEFT_CHILD(p, NULL);
+    SET_RIGHT_CHILD(p, NULL);
+    SET_PARENT(p, parent);
+    if (parent == NULL)
+        TREE_ROOT(a) = p;
+    else if (compare(size, p, parent) < 0)
+        SET_LEFT_CHILD(parent, p);
+    else
+        SET_RIGHT_CHILD(parent, p);
+    while (PARENT(p) != NULL && PRIORITY(PARENT(p)) < PRIORITY(p)) {
+        if (LEFT_CHILD(PARENT(p)) == p)
+            rotate_right(a, PARENT(p));
+        else
+            rotate_left(a, PARENT(p));
+    }
+    a->nonempty |= 1u << SEGLIST_BLOCKS;
+}
+
+// remove a node from the tree by rotating it down until it has at most one child
+static void remove_from_tree(arena_t *a, word_t *p) {
+    while (LEFT_CHILD(p) != NULL && RIGHT_CHILD(p) != NULL) {
+        if (PRIORITY(LEFT_CHILD(p)) > PRIORITY(RIGHT_CHILD(p)))
+            rotate_right(a, p);
+        else
+            rotate_left(a, p);
+    }
+    word_t *c = LEFT_CHILD(p) != NULL ? LEFT_CHILD(p) : RIGHT_CHILD(p);
+    if (c != NULL)
+        SET_PARENT(c, PARENT(p));
+    replace_child(a, PARENT(p), p, c);
+    if (TREE_ROOT(a) == NULL)
+        a->nonempty &= ~(1u << SEGLIST_BLOCKS);
+}
+
+// find the smallest node in the tree which is able to store the information
+// among nodes of the same size, the one of the lowest address is found
+static word_t *search_tree(arena_t *a, size_t size) {
+    word_t *best = NULL;
+    word_t *t = TREE_ROOT(a);
+    size_t steps = 0;
+    while (t != NULL) {
+        steps++;
+        if (GET_SIZE(t) >= size) {
+            best = t;
+            t = LEFT_CHILD(t);
+        } else {
+            t = RIGHT_CHILD(t);
+        }
+    }
+    a->stats.search_steps += steps;
+    return best;
+}
+
+// the size class of a free block in mm_stats_t
+static size_t free_class(size_t size) {
+    size_t k = LOG2(size) - 4;
+    return k < MM_FREE_CLASSES ? k : MM_FREE_CLASSES - 1;
+}
+
+// count a free block added to the lists or the tree, or removed from them if sign is -1
+static void count_free(arena_t *a, size_t size, int sign) {
+    a->stats.free_blocks += sign;
+    a->stats.free_bytes += sign * size;
+    a->stats.free_class_bytes[free_class(size)] += sign * size;
 }
 
 // remove a node from the free list
 // information in the overhead blocks of the current node is not changed
-static void remove_from_list(size_t *p) {
+static void remove_from_list(arena_t *a, word_t *p) {
+    count_free(a, GET_SIZE(p), -1);
+    if (find_index(GET_SIZE(p)) == SEGLIST_BLOCKS) {
+        remove_from_tree(a, p);
+        return;
+    }
 
-    size_t *prev = PREV_NODE_ADDRESS(p);
-    size_t *next = NEXT_NODE_ADDRESS(p);
+    word_t *prev = PREV_NODE_ADDRESS(p);
+    word_t *next = NEXT_NODE_ADDRESS(p);
     // change the overehads of the next and previous nodes
     if (prev != NULL) {
-        NEXT_NODE_OH(prev) = next;
+        SET_NEXT_NODE(prev, next);
     } else {
-        size_t **head = (size_t **)(mem_heap_lo() + find_index(*p - 1) * SIZE_T_SIZE);
-        *head = next;
+        size_t i = find_index(GET_SIZE(p));
+        GET_HEAD(a, i) = next;
+        if (next == NULL)
+            a->nonempty &= ~(1u << i);
     }
     if (next != NULL)
-        PREV_NODE_OH(next) = prev;
+        SET_PREV_NODE(next, prev);
 
     return;
 }
 
 // add a free block to list and in the meantime change the information in the overhead blocks
-static void add_to_list(size_t *p, size_t size) {
-    // update overheads of the current node
-    *p = size + 1;
-    *(size_t *)(((char *) p) + size - SIZE_T_SIZE) = size + 1;
+// the block before a free block is always allocated since free blocks are coalesced
+static void add_to_list(arena_t *a, word_t *p, size_t size) {
+    // update overheads of the current node and the top of the next block
+    *p = size | FREE_BIT | PREV_ALLOC_BIT;
+    *(word_t *)(((char *) p) + size - WSIZE) = size | FREE_BIT;
+    *NEXT_BLOCK(p) &= ~PREV_ALLOC_BIT;
+    count_free(a, size, 1);
 
     size_t i = find_index(size);
-    size_t **head =  (size_t **)(mem_heap_lo() + i * SIZE_T_SIZE);
-    PREV_NODE_OH(p) = NULL;
-    NEXT_NODE_OH(p) = NULL;
-    // update overheads of the next and the previous nodes
-    if (*head != NULL) {
-        NEXT_NODE_OH(p) = *head;
-        PREV_NODE_OH(*head) = p;
+    if (i == SEGLIST_BLOCKS) {
+        add_to_tree(a, p, size);
+        return;
     }
+    word_t **head = &GET_HEAD(a, i);
+    SET_PREV_NODE(p, NULL);
+    SET_NEXT_NODE(p, *head);
+    // update overheads of the next and the previous nodes
+    if (*head != NULL)
+        SET_PREV_NODE(*head, p);
     *head = p;
+    a->nonempty |= 1u << i;
 }
 
 // for a given size, find the best node in the i-th free list
 // which is able to store the information
-static size_t *search(size_t i, size_t size) {
-    // if this size is greater than the current max size, simply return NULL
-    if (curr_max != 0 && curr_max < size)
-        return NULL;
-    size_t *p = GET_HEAD(i);
-    if (p == NULL) {
-        return NULL;
-    }
-    // travel through the i-th list to find the first fit
-    size_t *best = NULL;
-    while (p != NULL) {
-        if (*p - 1 >= size) {
-            best = p;
-            break;
-        }
-        if (*p - 1 > curr_max)
-            curr_max = *p - 1;
-        p = NEXT_NODE_ADDRESS(p);
-    }
-    // no suitable node
-    if (best == NULL) {
-        return NULL;
+static word_t *search(arena_t *a, size_t i, size_t size) {
+    if (i == SEGLIST_BLOCKS)
+        return search_tree(a, size);
+    word_t *p = GET_HEAD(a, i);
+    // every node in a list above the list of this size is large enough, so the head is good
+    if (p == NULL || i > find_index(size)) {
+        return p;
     }
-    // find the best node
+    // travel through the i-th list to find the best fit, which is the first node of the smallest size,
+    // and stop at an exact fit since no node after it can be better
+    word_t *best = NULL;
+    size_t best_size = (size_t) -1;
+    size_t steps = 0;
     while (p != NULL) {
-        //printf("%d ", *p);
-        if (*p - 1 >= size && *p < *best) {
+        size_t s = GET_SIZE(p);
+        steps++;
+        if (s >= size && s < best_size) {
             best = p;
+            best_size = s;
+            if (s == size)
+                break;
         }
-        if (*p - 1 > curr_max)
-            curr_max = *p - 1;
         p = NEXT_NODE_ADDRESS(p);
     }
-    if (curr_max == *best - 1)
-        curr_max = 0;
 
+    a->stats.search_steps += steps;
     return best;
 }
 
 // split the current node into two parts where the first part is the desired size
 // and then remove the first part from the list
 // the splitting will not happen if the remaining size is too small to store overheads
-static void split(size_t *best, size_t size) {
+static void split(arena_t *a, word_t *best, size_t size) {
     // remove the whole node
-    remove_from_list(best);
-    size_t remain_size = *best - 1 - size;
+    remove_from_list(a, best);
+    size_t remain_size = GET_SIZE(best) - size;
     // if the remaining size is large enough, add back the remaining part
-    if (remain_size >= FREE_OVERHEAD_BLOCKS * SIZE_T_SIZE) {
+    if (remain_size >= MIN_BLOCK_SIZE) {
+        *best = size | IS_PREV_ALLOC(best);
+        add_to_list(a, (word_t *)(((char *)best) + size), remain_size);
+    } else {
+        *best &= ~FREE_BIT;
+        *NEXT_BLOCK(best) |= PREV_ALLOC_BIT;
+    }
+    a->stats.alloc_blocks++;
+    a->stats.alloc_bytes += GET_SIZE(best);
+}
+
+// take at least *n bytes from mem_sbrk for the arena, and set *n to the number of bytes taken
+// the bytes continue the newest segment of the arena if it ends at the end of the heap,
+// otherwise room for the head of a segment and the epilogue is added
+// if contiguous is set, nothing is taken unless the newest segment can be continued
+// return the old end of the heap, or NULL on failure
+static char *get_memory(arena_t *a, size_t *n, int contiguous) {
+    lock(&sbrk_lock);
+    char *lo = mem_heap_lo();
+    char *brk = ((char *) mem_heap_hi()) + 1;
+    int at_end = a->last != NULL && ((char *) a->last) + WSIZE == brk;
+    char *p = NULL;
+    if (at_end || !contiguous) {
+        // with several arenas, a new segment takes twice the bytes asked for, so that a block
+        // growing by realloc finds room after it instead of starting a new segment every time
+        size_t incr = at_end ? *n : *n + SEGMENT_OVERHEAD;
+        if (!at_end && num_arenas > 1)
+            incr *= 2;
+        incr = ROUND_CHUNK(incr);
+        if ((size_t)(brk - lo) + incr <= HEAP_LIMIT) {
+            tcache.fresh = mem_untouched();
+            p = mem_sbrk((intptr_t) incr);
+            if (p == (void *) -1) {
+                p = NULL;
+            } else {
+                *n = incr;
+                if (trimmed != 0 && trim_threshold < 2 * trimmed)
+                    trim_threshold = 2 * trimmed < TRIM_THRESHOLD_MAX ? 2 * trimmed : TRIM_THRESHOLD_MAX;
+                trimmed = 0;
+                if (num_arenas > 1)
+                    memset(chunk_owner + ((p - lo) >> CHUNK_LOG), a - arenas, incr >> CHUNK_LOG);
+            }
+        }
+    }
+    unlock(&sbrk_lock);
+    return p;
+}
 
-        add_to_list((size_t *)(((char *)best) + size), remain_size);
-        *best = size;
-        *(size_t *)(((char *) best) + size - SIZE_T_SIZE) = size;
+// make the block of the given size the first one in the memory up to end, with the epilogue at the end
+// the rest of the memory becomes a free block if it is large enough, otherwise it is kept in the block
+// the bit of the previous block in the top of the block must be set already
+static void set_end(arena_t *a, word_t *block, char *end, size_t size) {
+    word_t *epilogue = (word_t *)(end - WSIZE);
+    size_t remain_size = ((char *) epilogue) - ((char *) block) - size;
+    if (remain_size < MIN_BLOCK_SIZE) {
+        size += remain_size;
+        remain_size = 0;
+    }
+    *block = size | IS_PREV_ALLOC(block);
+    *epilogue = PREV_ALLOC_BIT;
+    a->last = epilogue;
+    if (remain_size != 0)
+        add_to_list(a, (word_t *)(((char *) block) + size), remain_size);
+}
+
+// place a new block of the given size at the end of the newest segment of the arena
+// the block starts at the old epilogue, or right after the head of the segment
+// if a new segment is started
+// if whole is set, the block takes all the memory up to the epilogue instead of the given size,
+// which lets a block growing by realloc stay at the end of its segment
+static word_t *place_at_end(arena_t *a, size_t size, int whole) {
+    size_t n = size;
+    char *p = get_memory(a, &n, 0);
+    if (p == NULL)
+        return NULL;
+    word_t *block;
+    if (a->last != NULL && p == ((char *) a->last) + WSIZE) {
+        block = a->last;
     } else {
-        (*best)--;
-        (*(size_t *)(((char *) best) + (*best) - SIZE_T_SIZE))--;
+        *(void **)p = a->segments;
+        a->segments = (void **)p;
+        block = (word_t *)(p + SEGMENT_HEAD);
+        *block = PREV_ALLOC_BIT;
     }
+    set_end(a, block, p + n, whole ? (size_t)(p + n - WSIZE - (char *) block) : size);
+    a->stats.alloc_blocks++;
+    a->stats.alloc_bytes += GET_SIZE(block);
+    return block;
 }
 
-// find and split a required block in the i-th list
-static void *find_best_fit(size_t i , size_t size) {
+// find the list from which a block of the given size is taken
+// this is the list of the size itself if it has a fit, otherwise the first non-empty larger list
+static word_t *search_lists(arena_t *a, size_t size) {
+    size_t i = find_index(size);
+    a->stats.searches++;
+    word_t *p = search(a, i, size);
+    if (p != NULL)
+        return p;
+    // clear the bits of the lists no larger than the i-th one
+    unsigned int larger = a->nonempty & ~((2u << i) - 1);
+    if (larger == 0)
+        return NULL;
+    return search(a, __builtin_ctz(larger), size);
+}
 
-    size_t * best = search(i, size);
+// find and split a required block in the lists
+static void *find_best_fit(arena_t *a, size_t size) {
+
+    word_t * best = search_lists(a, size);
 
     if (best == NULL)
         return NULL;
 
-    split(best, size);
+    split(a, best, size);
 
-    return (void *)((char *)best + SIZE_T_SIZE);
+    return (void *)((char *)best + WSIZE);
 }
 
+// the size of the block for a payload of the given size
+static size_t block_size(size_t size) {
+    size_t newsize = ALIGN(size + ALLOCATED_OVERHEAD_BLOCKS * WSIZE);
+    if (newsize < MIN_BLOCK_SIZE)
+        newsize = MIN_BLOCK_SIZE;
+    return newsize;
+}
 
-/* 
- * mm_malloc - Allocate a block firstly by finding a best fit in the existing list
- * if there is no such a fit, then increment brk to get extra space
- */
+#ifdef DEFERRED_COALESCING
+static void *take_deferred(arena_t *a, size_t size);
+static int coalesce_deferred(arena_t *a);
+#endif
 
-void *mm_malloc(size_t size)
-{
-    // calculate the aligned size
-    size_t newsize = ALIGN(size) + ALLOCATED_OVERHEAD_BLOCKS * SIZE_T_SIZE;
-    size_t i = find_index(newsize);
+// allocate a block of the given size, overheads included, in the arena, whose lock is held
+static void *malloc_block(arena_t *a, size_t newsize) {
     void *p;
-    // try finding a fit in the list
-    while (i < SEGLIST_BLOCKS) {
-        if ((p = find_best_fit(i, newsize)) != NULL) {
+#ifdef DEFERRED_COALESCING
+    // a block freed at the same size is taken back as it is
+    if ((p = take_deferred(a, newsize)) != NULL)
+        return p;
+#endif
+    // try finding a fit in the lists
+    if ((p = find_best_fit(a, newsize)) != NULL) {
+        return p;
+    }
+#ifdef DEFERRED_COALESCING
+    // otherwise coalescing the deferred blocks may make room
+    if (coalesce_deferred(a) && (p = find_best_fit(a, newsize)) != NULL)
+        return p;
+#endif
+    // if there is no such a fit, get some extra space
+    word_t *block = place_at_end(a, newsize, 0);
+    if (block == NULL)
+        return NULL;
+    return (void *)(((char *) block) + WSIZE);
+}
+
+// allocate up to n blocks of the given size, overheads included, in the arena, whose lock is held,
+// and store their payloads in out
+// they are cut out of a single block, which is a fit in the lists for as many of them as there is one for,
+// halving their number until there is, or otherwise the memory placed at the end of the heap for all of them
+// the last block keeps what is left over when that block is too small to split
+// return the number of blocks allocated, which is 0 on failure
+static size_t malloc_blocks(arena_t *a, size_t newsize, size_t n, void **out) {
+    size_t m = n;
+    word_t *block;
+    while ((block = search_lists(a, newsize * m)) == NULL && m > 1)
+        m /= 2;
+#ifdef DEFERRED_COALESCING
+    if (block == NULL && coalesce_deferred(a))
+        for (m = n; (block = search_lists(a, newsize * m)) == NULL && m > 1; )
+            m /= 2;
+#endif
+    if (block != NULL) {
+        split(a, block, newsize * m);
+    } else {
+        m = n;
+        if ((block = place_at_end(a, newsize * m, 0)) == NULL)
+            return 0;
+    }
+    char *end = ((char *) block) + GET_SIZE(block);
+    // every block but the first follows an allocated block
+    for (size_t j = 0; j < m - 1; j++) {
+        *block = newsize | IS_PREV_ALLOC(block);
+        out[j] = ((char *) block) + WSIZE;
+        block = (word_t *)(((char *) block) + newsize);
+        *block = PREV_ALLOC_BIT;
+    }
+    *block = (end - (char *) block) | IS_PREV_ALLOC(block);
+    out[m - 1] = ((char *) block) + WSIZE;
+    a->stats.alloc_blocks += m - 1;
+    return m;
+}
+
+// free a block of the arena, whose lock is held
+// return the free block it has been coalesced into, or NULL if it was already free
+static word_t *free_block(arena_t *a, void *ptr) {
+    word_t *p = (word_t *)(ptr - WSIZE);
+    if (is_free(p)) {
+        printf("This block is already free\n");
+        return NULL;
+    }
+    size_t total_size = GET_SIZE(p);
+    a->stats.alloc_blocks--;
+    a->stats.alloc_bytes -= total_size;
+    // check if the next block is free, the epilogue at the end of a segment never is
+    word_t *next_nbhd = NEXT_BLOCK(p);
+    if (is_free(next_nbhd)) {
+        total_size += GET_SIZE(next_nbhd);
+        remove_from_list(a, next_nbhd);
+    }
+
+    // check if the previous block is free, its bottom is only valid in this case
+    if (!IS_PREV_ALLOC(p)) {
+        p = PREV_BLOCK(p);
+        total_size += GET_SIZE(p);
+        remove_from_list(a, p);
+    }
+
+    // add the combined block to the list
+    add_to_list(a, p, total_size);
+    return p;
+}
+
+// split an allocated block into a first part of the given size and the rest, and free the rest
+// which must be large enough to be a block
+static void free_tail(arena_t *a, word_t *block, size_t size) {
+    word_t *rest = (word_t *)(((char *) block) + size);
+    *rest = (GET_SIZE(block) - size) | PREV_ALLOC_BIT;
+    *block = size | IS_PREV_ALLOC(block);
+    a->stats.alloc_blocks++;
+    free_block(a, ((char *) rest) + WSIZE);
+}
+
+// reallocate a block of the arena, whose lock is held
+// the block is resized in place whenever its free neighbours allow it, and only moved otherwise
+static void *realloc_block(arena_t *a, void *ptr, size_t size) {
+    // calculate the size of the orginal block and the new aligned size
+    word_t *block = (word_t *)(((char *)ptr) - WSIZE);
+    size_t prev_size = GET_SIZE(block);
+    size_t newsize = block_size(size);
+
+    // when the size is enough, the tail is split off if it can be a block
+    if (newsize <= prev_size) {
+        if (prev_size - newsize >= MIN_BLOCK_SIZE)
+            free_tail(a, block, newsize);
+        return ptr;
+    }
+
+    // the next block can be taken if it is free
+    word_t *next = NEXT_BLOCK(block);
+    size_t next_size = is_free(next) ? GET_SIZE(next) : 0;
+    if (prev_size + next_size >= newsize) {
+        remove_from_list(a, next);
+        *block = (prev_size + next_size) | IS_PREV_ALLOC(block);
+        *NEXT_BLOCK(block) |= PREV_ALLOC_BIT;
+        a->stats.alloc_bytes += next_size;
+        if (prev_size + next_size - newsize >= MIN_BLOCK_SIZE)
+            free_tail(a, block, newsize);
+        return ptr;
+    }
+
+    // deal with the special case when the block, or the free block after it, is at the end of the heap
+    // this optimization is for some test cases
+    if ((word_t *)(((char *)next) + next_size) == a->last) {
+        // add more size directly to the bottom of the heap
+        size_t n = newsize - prev_size - next_size;
+        char *p = get_memory(a, &n, 1);
+        if (p != NULL) {
+            if (next_size != 0)
+                remove_from_list(a, next);
+            set_end(a, block, p + n, prev_size + next_size + n);
+            a->stats.alloc_bytes += GET_SIZE(block) - prev_size;
+            return ptr;
+        }
+        // another arena has taken the memory after the segment, so the block is moved
+    }
+
+    // the previous block can be taken if it is free, and the payload is moved down into it
+    if (!IS_PREV_ALLOC(block)) {
+        word_t *prev = PREV_BLOCK(block);
+        size_t total = GET_SIZE(prev) + prev_size + next_size;
+        if (total >= newsize) {
+            remove_from_list(a, prev);
+            if (next_size != 0)
+                remove_from_list(a, next);
+            // the block before a free block is always allocated
+            *prev = total | PREV_ALLOC_BIT;
+            *NEXT_BLOCK(prev) |= PREV_ALLOC_BIT;
+            a->stats.alloc_bytes += total - prev_size;
+            memmove(prev + 1, ptr, prev_size - WSIZE);
+            tcache.copied += prev_size - WSIZE;
+            if (total - newsize >= MIN_BLOCK_SIZE)
+                free_tail(a, prev, newsize);
+            return prev + 1;
+        }
+    }
+
+    // record the information contained in the "next" "prev" "parent" and "bottom" blocks
+    // this is necessary because our implementation of free() will change these blocks
+    // and the bottom of a free block is the last word of the payload of an allocated block
+    word_t temp[FREE_OVERHEAD_BLOCKS - 1];
+    memcpy(temp, ptr, LINK_BYTES);
+    word_t bottom = *(word_t *)(((char *)block) + prev_size - WSIZE);
+
+    // the block grows, so the whole payload is kept
+    size_t old_payload = prev_size - WSIZE;
+
+    // otherwise simply free the block and allocate the space
+    // and then copy the original data
+    free_block(a, ptr);
+
+    word_t *p = search_lists(a, newsize);
+
+    if (p != NULL) {
+        memmove(((char *)p) + WSIZE + LINK_BYTES, ((char *)ptr) + LINK_BYTES, old_payload - LINK_BYTES);
+        split(a, p, newsize);
+        p = (word_t *)(((char *)p) + WSIZE);
+    } else {
+        p = place_at_end(a, newsize, 1);
+
+        if (p == NULL)
+            return NULL;
+        p = (word_t *)(((char *)p) + WSIZE);
+        memmove(((char *)p) + LINK_BYTES, ((char *)ptr) + LINK_BYTES, old_payload - LINK_BYTES);
+    }
+    tcache.copied += old_payload;
+
+    memcpy(p, temp, LINK_BYTES);
+    *(word_t *)(((char *)p) + old_payload - WSIZE) = bottom;
+
+    return p;
+}
+
+// allocate a block of the given size, overheads included, in the arena, whose payload is aligned
+// to align, a power of two no less than ALIGNMENT
+// a larger block is allocated, and the parts before and after the aligned payload are freed
+static void *memalign_block(arena_t *a, size_t align, size_t newsize) {
+    char *p = malloc_block(a, newsize + align + MIN_BLOCK_SIZE);
+    if (p == NULL)
+        return NULL;
+    word_t *block = (word_t *)(p - WSIZE);
+    if (((size_t) p & (align - 1)) != 0) {
+        // the part before is made large enough to be a block
+        char *q = (char *)(((size_t) p + MIN_BLOCK_SIZE + align - 1) & ~(align - 1));
+        word_t *aligned = (word_t *)(q - WSIZE);
+        *aligned = (GET_SIZE(block) - (q - p)) | PREV_ALLOC_BIT;
+        *block = (q - p) | IS_PREV_ALLOC(block);
+        a->stats.alloc_blocks++;
+        free_block(a, p);
+        block = aligned;
+        p = q;
+    }
+    if (GET_SIZE(block) - newsize >= MIN_BLOCK_SIZE)
+        free_tail(a, block, newsize);
+    return p;
+}
+
+// set or clear the bit of a slab page in slab_map
+static void mark_slab(slab_t *s, int on) {
+    size_t i = SLAB_INDEX(s);
+    if (on) {
+        slab_map[i >> 3] |= 1 << (i & 7);
+        if ((i >> 3) + 1 > slab_map_size)
+            slab_map_size = (i >> 3) + 1;
+    } else {
+        slab_map[i >> 3] &= ~(1 << (i & 7));
+    }
+}
+
+// remove a page from the list of pages with free slots of its arena
+static void unlink_slab(arena_t *a, slab_t *s) {
+    if (s->prev != NULL)
+        s->prev->next = s->next;
+    else
+        a->slabs[s->cls] = s->next;
+    if (s->next != NULL)
+        s->next->prev = s->prev;
+}
+
+// add a page to the list of pages with free slots of its arena
+static void link_slab(arena_t *a, slab_t *s) {
+    s->prev = NULL;
+    s->next = a->slabs[s->cls];
+    if (s->next != NULL)
+        s->next->prev = s;
+    a->slabs[s->cls] = s;
+}
+
+// allocate a new slab page for the slot size of index cls
+// the page itself is not counted in the stats, only the slots in use are
+static slab_t *new_slab(arena_t *a, size_t cls) {
+    slab_t *s = memalign_block(a, SLAB_PAGE, block_size(SLAB_PAGE));
+    if (s == NULL)
+        return NULL;
+    a->stats.alloc_blocks--;
+    a->stats.alloc_bytes -= GET_SIZE(((char *) s) - WSIZE);
+    s->size = (cls + 1) * ALIGNMENT;
+    s->cls = cls;
+    s->used = 0;
+    s->slots = (SLAB_PAGE - SLAB_HEADER) / s->size;
+    // the bits after the last slot are set, so that they are never found free
+    for (size_t w = 0; w < SLAB_MAP_WORDS; w++) {
+        if (s->slots >= (w + 1) * 64)
+            s->map[w] = 0;
+        else if (s->slots <= w * 64)
+            s->map[w] = ~0ULL;
+        else
+            s->map[w] = ~0ULL << (s->slots - w * 64);
+    }
+    mark_slab(s, 1);
+    link_slab(a, s);
+    return s;
+}
+
+// allocate a slot of the size of index cls in the arena, whose lock is held
+static void *slab_alloc(arena_t *a, size_t cls) {
+    slab_t *s = a->slabs[cls];
+    if (s == NULL && (s = new_slab(a, cls)) == NULL)
+        return NULL;
+    // the page has a free slot, so one of the words has a clear bit
+    size_t w = 0;
+    while (s->map[w] == ~0ULL)
+        w++;
+    size_t k = __builtin_ctzll(~s->map[w]);
+    s->map[w] |= 1ULL << k;
+    if (++s->used == s->slots)
+        unlink_slab(a, s);
+    a->stats.alloc_blocks++;
+    a->stats.alloc_bytes += s->size;
+    return ((char *) s) + SLAB_HEADER + (w * 64 + k) * s->size;
+}
+
+// free a slot of a slab page of the arena, whose lock is held
+// a page with no slot in use is freed, unless it is the only page of its slot size with free slots
+static void slab_free(arena_t *a, void *ptr) {
+    slab_t *s = SLAB_OF(ptr);
+    size_t k = (((char *) ptr) - ((char *) s) - SLAB_HEADER) / s->size;
+    if (!(s->map[k / 64] & (1ULL << (k % 64)))) {
+        printf("This block is already free\n");
+        return;
+    }
+    s->map[k / 64] &= ~(1ULL << (k % 64));
+    if (s->used-- == s->slots)
+        link_slab(a, s);
+    a->stats.alloc_blocks--;
+    a->stats.alloc_bytes -= s->size;
+    if (s->used == 0 && (s->next != NULL || s->prev != NULL)) {
+        unlink_slab(a, s);
+        mark_slab(s, 0);
+        a->stats.alloc_blocks++;
+        a->stats.alloc_bytes += GET_SIZE(((char *) s) - WSIZE);
+        free_block(a, s);
+    }
+}
+
+// give the memory of a free block of the arena back to the system, whose lock is held
+// the block is cut down to TRIM_PAD bytes by a negative mem_sbrk if it is at the end of the heap,
+// otherwise the whole pages between lo and hi, the bytes which have just become free, are released,
+// keeping the words of the node and the bottom
+static void give_back(arena_t *a, word_t *block, char *lo, char *hi) {
+    size_t size = GET_SIZE(block);
+    if (NEXT_BLOCK(block) == a->last) {
+        lock(&sbrk_lock);
+        // with several arenas, the heap is still made of whole chunks
+        size_t unit = num_arenas > 1 ? CHUNK_SIZE : mem_pagesize();
+        size_t n = (size - TRIM_PAD) & ~(unit - 1);
+        int at_end = ((char *) a->last) + WSIZE == ((char *) mem_heap_hi()) + 1;
+        if (at_end && n != 0 && mem_sbrk(-(intptr_t) n) != (void *) -1) {
+            remove_from_list(a, block);
+            size -= n;
+            // the new epilogue follows a free block
+            a->last = (word_t *)(((char *) block) + size);
+            *a->last = 0;
+            add_to_list(a, block, size);
+            trimmed += n;
+        }
+        unlock(&sbrk_lock);
+        return;
+    }
+    if (lo < ((char *) block) + FREE_OVERHEAD_BLOCKS * WSIZE)
+        lo = ((char *) block) + FREE_OVERHEAD_BLOCKS * WSIZE;
+    if (hi > ((char *) block) + size - WSIZE)
+        hi = ((char *) block) + size - WSIZE;
+    if (lo < hi)
+        mem_release(lo, hi);
+}
+
+// free a block of the arena, whose lock is held, and give the memory of the free block
+// it ends up in back to the system if it is large enough
+// a free neighbour it is coalesced with was released already if it was large enough on its own,
+// so that only the freed block and the smaller neighbours are released, not the whole free block every time
+// return the free block, or NULL if it was already free
+static word_t *free_and_trim(arena_t *a, void *ptr) {
+    char *lo = ((char *) ptr) - WSIZE;
+    char *hi = lo + GET_SIZE((word_t *) lo);
+    word_t *block = free_block(a, ptr);
+    if (block == NULL)
+        return NULL;
+    size_t size = GET_SIZE(block);
+    if (size >= trim_threshold) {
+        char *end = ((char *) block) + size;
+        if ((size_t)(lo - (char *) block) < trim_threshold)
+            lo = (char *) block;
+        if ((size_t)(end - hi) < trim_threshold)
+            hi = end;
+        give_back(a, block, lo, hi);
+    }
+    return block;
+}
+
+#ifdef DEFERRED_COALESCING
+// put a block of the arena, whose lock is held, on the quick list of its size class
+// it is not coalesced and stays allocated as far as its neighbours know,
+// so that it can be taken again at the same size without touching the lists
+static void defer_free(arena_t *a, void *ptr) {
+    size_t size = GET_SIZE(((char *) ptr) - WSIZE);
+    size_t i = find_index(size);
+    *(void **)ptr = a->quick[i];
+    a->quick[i] = ptr;
+    a->stats.alloc_blocks--;
+    a->stats.alloc_bytes -= size;
+    if (++a->deferred == QUICK_LIMIT)
+        coalesce_deferred(a);
+}
+
+// take a block from the quick lists which is at least size bytes but too small to be split
+static void *take_deferred(arena_t *a, size_t size) {
+    void **link = &a->quick[find_index(size)];
+    while (*link != NULL) {
+        void *p = *link;
+        size_t block_size = GET_SIZE(((char *) p) - WSIZE);
+        if (block_size >= size && block_size - size < MIN_BLOCK_SIZE) {
+            *link = *(void **)p;
+            a->deferred--;
+            a->stats.alloc_blocks++;
+            a->stats.alloc_bytes += block_size;
             return p;
         }
-        i++;
+        link = (void **)p;
     }
-    // if there is no such a fit, get some extra space
-    p = mem_sbrk(newsize);
+    return NULL;
+}
 
-    if (p == (void *)-1)
-	    return NULL;
-    else {
-        *(size_t *)p = newsize;
-        *(size_t *)(((char *) p) + newsize - SIZE_T_SIZE) = newsize;
-        return (void *)((char *)p + SIZE_T_SIZE);
+// free the blocks on the quick lists for real, each of which is coalesced with the free blocks
+// around it, so that every run of adjacent free blocks ends up as a single block
+// return 0 if there were none
+static int coalesce_deferred(arena_t *a) {
+    if (a->deferred == 0)
+        return 0;
+    for (size_t i = 0; i <= SEGLIST_BLOCKS; i++) {
+        void *p = a->quick[i];
+        while (p != NULL) {
+            void *next = *(void **)p;
+            a->stats.alloc_blocks++;
+            a->stats.alloc_bytes += GET_SIZE(((char *) p) - WSIZE);
+            free_and_trim(a, p);
+            p = next;
+        }
+        a->quick[i] = NULL;
     }
+    a->deferred = 0;
+    return 1;
+}
+#endif
+
+// free a slot or a block of the arena, whose lock is held
+static void release(arena_t *a, void *ptr) {
+    if (is_slab(ptr))
+        slab_free(a, ptr);
+    else
+#ifdef DEFERRED_COALESCING
+        defer_free(a, ptr);
+#else
+        free_block(a, ptr);
+#endif
 }
 
+// check if a payload is in a block with a mapping of its own, which is never inside the heap
+// a block of the heap is always below the end of the heap, even while other threads move it
+static int is_mapped(void *ptr) {
+    return (char *) ptr < heap_lo || (char *) ptr > (char *) mem_heap_hi();
+}
+
+// add a block with a mapping of its own to the list
+static void link_mapped(mapped_t *m) {
+    lock(&map_lock);
+    m->prev = NULL;
+    m->next = mapped;
+    if (mapped != NULL)
+        mapped->prev = m;
+    mapped = m;
+    mapped_blocks++;
+    mapped_bytes += m->size;
+    unlock(&map_lock);
+}
+
+// remove a block with a mapping of its own from the list
+// if it is freed, the threshold may rise to its size
+static void unlink_mapped(mapped_t *m, int freed) {
+    lock(&map_lock);
+    size_t payload = m->size - MAPPED_HEADER;
+    if (freed && !mmap_threshold_fixed && payload > mmap_threshold && payload <= MMAP_THRESHOLD_MAX)
+        mmap_threshold = payload;
+    if (m->prev != NULL)
+        m->prev->next = m->next;
+    else
+        mapped = m->next;
+    if (m->next != NULL)
+        m->next->prev = m->prev;
+    mapped_blocks--;
+    mapped_bytes -= m->size;
+    unlock(&map_lock);
+}
+
+// the length of the mapping of a block with a payload of the given size, in whole pages
+// the callers refuse payloads larger than HEAP_LIMIT, so that the sum does not wrap around
+static size_t mapped_size(size_t size) {
+    size_t page = mem_pagesize();
+    return (MAPPED_HEADER + size + page - 1) & ~(page - 1);
+}
+
+// allocate a block with a mapping of its own
+static void *map_alloc(size_t size) {
+    size_t length = mapped_size(size);
+    mapped_t *m = mem_map(length);
+    if (m == NULL)
+        return NULL;
+    m->size = length;
+    link_mapped(m);
+    return ((char *) m) + MAPPED_HEADER;
+}
+
+// free a block with a mapping of its own, which is unmapped at once
+static void map_free(void *ptr) {
+    mapped_t *m = MAPPED_OF(ptr);
+    unlink_mapped(m, 1);
+    mem_unmap(m, m->size);
+}
+
+// resize a block with a mapping of its own with mem_remap, which moves the pages without copying them
+static void *map_realloc(void *ptr, size_t size) {
+    mapped_t *m = MAPPED_OF(ptr);
+    size_t length = mapped_size(size);
+    if (length == m->size)
+        return ptr;
+    unlink_mapped(m, 0);
+    mapped_t *q = mem_remap(m, m->size, length);
+    if (q == NULL) {
+        link_mapped(m);
+        return NULL;
+    }
+    q->size = length;
+    link_mapped(q);
+    return ((char *) q) + MAPPED_HEADER;
+}
+
+// push a block onto the stack of blocks freed by other threads of its arena
+// the stack is linked through the first word of the payloads, so no lock is needed
+static void remote_free(arena_t *a, void *ptr) {
+    void *head = __atomic_load_n(&a->remote, __ATOMIC_RELAXED);
+    do {
+        *(void **)ptr = head;
+    } while (!__atomic_compare_exchange_n(&a->remote, &head, ptr, 1,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+// take the lock of the arena of the current thread, add the counters of the cache to it
+// and free the blocks other threads have pushed onto its stack in the meantime
+static arena_t *lock_arena(void) {
+    arena_t *a = current_arena();
+    lock(&a->lock);
+    a->stats.tcache_hits += tcache.hits;
+    a->stats.tcache_misses += tcache.misses;
+    a->stats.realloc_copied += tcache.copied;
+    tcache.hits = tcache.misses = tcache.copied = 0;
+    if (__atomic_load_n(&a->remote, __ATOMIC_RELAXED) != NULL) {
+        void *p = __atomic_exchange_n(&a->remote, NULL, __ATOMIC_ACQUIRE);
+        while (p != NULL) {
+            void *next = *(void **)p;
+            release(a, p);
+            p = next;
+        }
+    }
+    return a;
+}
+
+// free the blocks in the i-th bin of the cache to the arena of the current thread, whose lock is held
+static void flush_bin(arena_t *a, size_t i) {
+    void *p = tcache.bins[i];
+    while (p != NULL) {
+        void *next = *(void **)p;
+        release(a, p);
+        p = next;
+    }
+    tcache.bins[i] = NULL;
+    tcache.counts[i] = 0;
+}
+
+// free all the blocks in the cache of a thread which exits
+static void flush_tcache(void *unused) {
+    if (tcache.gen != heap_gen)
+        return;
+    arena_t *a = lock_arena();
+    for (size_t i = 0; i < TCACHE_BINS; i++)
+        flush_bin(a, i);
+    unlock(&a->lock);
+}
 
 /*
- * mm_free - Freeing a block and check if the two blocks next to it are free or not
- * if so, combine these free blocks together and add the result to the list
+ * mm_set_sample_period - turn on the sampling profiler with a sample every period allocated bytes,
+ * or turn it off with a period of 0, which forgets the sampled payloads
  */
-void mm_free(void *ptr)
+void mm_set_sample_period(size_t period)
 {
+    lock(&sample_lock);
+    __atomic_store_n(&sample_period, period, __ATOMIC_RELAXED);
+    if (period == 0 && num_samples != 0) {
+        memset(samples, 0, sizeof(samples));
+        __atomic_store_n(&num_samples, 0, __ATOMIC_RELAXED);
+    }
+    unlock(&sample_lock);
+    tcache.sample_left = period;
+}
 
-    size_t *p = (size_t *)(ptr - SIZE_T_SIZE);
-    if (p == NULL) {
-        printf("NULL Address\n");
-        return;
+/*
+ * mm_set_site - set the site recorded with the payloads the current thread samples from now on
+ */
+void mm_set_site(unsigned int site)
+{
+    current_arena();
+    tcache.site = site;
+}
+
+// record a sampled payload, replacing the record of a payload at the same address which was never freed
+// a sample is dropped when the table is full
+static void add_sample(void *ptr, size_t size, unsigned int hits) {
+    lock(&sample_lock);
+    size_t i = SAMPLE_HASH(ptr);
+    while (samples[i].ptr != NULL && samples[i].ptr != ptr)
+        i = (i + 1) % SAMPLE_SLOTS;
+    if (samples[i].ptr == NULL) {
+        if (num_samples >= SAMPLE_SLOTS / 4 * 3) {
+            unlock(&sample_lock);
+            return;
+        }
+        __atomic_store_n(&num_samples, num_samples + 1, __ATOMIC_RELAXED);
     }
-    if (is_free(p)) {
-        printf("This block is already free\n");
-        return;
+    samples[i].ptr = ptr;
+    samples[i].size = size;
+    samples[i].site = tcache.site;
+    samples[i].hits = hits;
+    unlock(&sample_lock);
+}
+
+// take a payload which is freed out of the table of sampled payloads, if it is there
+// the records after it which would no longer be found from their hash are moved back into the hole it leaves
+static void forget_sample(void *ptr) {
+    lock(&sample_lock);
+    size_t i = SAMPLE_HASH(ptr);
+    while (samples[i].ptr != ptr) {
+        if (samples[i].ptr == NULL) {
+            unlock(&sample_lock);
+            return;
+        }
+        i = (i + 1) % SAMPLE_SLOTS;
     }
-    size_t total_size = *p;
-    size_t *next_nbhd = (size_t *)(((char *)p) + *p);
-    // check if the next block is free
-    if ((void *)next_nbhd - 1 != mem_heap_hi()) {
-        if (is_free(next_nbhd)) {
-            total_size += (*(next_nbhd) - 1);
-            remove_from_list(next_nbhd);
+    for (size_t j = (i + 1) % SAMPLE_SLOTS; samples[j].ptr != NULL; j = (j + 1) % SAMPLE_SLOTS) {
+        size_t h = SAMPLE_HASH(samples[j].ptr);
+        int between = i < j ? h > i && h <= j : h > i || h <= j;
+        if (!between) {
+            samples[i] = samples[j];
+            i = j;
         }
     }
+    samples[i].ptr = NULL;
+    __atomic_store_n(&num_samples, num_samples - 1, __ATOMIC_RELAXED);
+    unlock(&sample_lock);
+}
 
+// the countdown of the thread ran out within the payload of size bytes at p, whose byte it ran out at is sampled,
+// unless the profiler is off, in which case the thread looks again after SAMPLE_POLL bytes
+// a payload spanning several periods holds as many sampled bytes, and the countdown restarts after the last one
+static void *take_sample(void *p, size_t size) {
+    size_t period = __atomic_load_n(&sample_period, __ATOMIC_RELAXED);
+    if (period == 0) {
+        tcache.sample_left = SAMPLE_POLL;
+        return p;
+    }
+    // the countdown was reset with the cache, or it is still polling since the profiler was turned on
+    size_t left = tcache.sample_left;
+    if (left == 0 || left > period)
+        left = period;
+    if (size < left) {
+        tcache.sample_left = left - size;
+        return p;
+    }
+    if (p != NULL)
+        add_sample(p, size, 1 + (size - left) / period);
+    tcache.sample_left = period - (size - left) % period;
+    return p;
+}
 
-    // check if the previous block is free
-    size_t *prev_nbhd = (size_t *)(((char *)p) - SIZE_T_SIZE);
-    if (is_free(prev_nbhd)) {
-        total_size += (*(prev_nbhd) - 1);
-        p = (size_t *)(((char *)p) - ((*prev_nbhd) - 1));
-        remove_from_list(p);
+// count an allocation of size bytes at p towards the next sample of the thread, and return p
+static inline void *count_sample(void *p, size_t size) {
+    if (tcache.sample_left > size) {
+        tcache.sample_left -= size;
+        return p;
     }
+    return take_sample(p, size);
+}
 
-    // add the combined block to the list
-    add_to_list(p, total_size);
-    if (total_size > curr_max && curr_max != 0)
-        curr_max = total_size;
+/*
+ * mm_malloc - Allocate a block firstly from the cache of the thread if it is small,
+ * then by finding a best fit in the lists of the arena
+ * if there is no such a fit, then increment brk to get extra space
+ */
 
+void *mm_malloc(size_t size)
+{
+    // a payload larger than the heap could never be allocated, and rounding its size up would wrap around
+    if (size > HEAP_LIMIT)
+        return tcache.touched = NULL;
+    if (size >= mmap_threshold)
+        return tcache.touched = count_sample(map_alloc(size), size);
+    size_t newsize = 0;
+    size_t i = TCACHE_BINS;
+    arena_t *a = current_arena();
+    if (size <= SLAB_LIMIT)
+        i = TCACHE_BLOCK_BINS + SLAB_CLASS(size);
+    else if ((newsize = block_size(size)) < TCACHE_LIMIT)
+        i = TCACHE_INDEX(newsize);
+    if (i < TCACHE_BINS) {
+        void *p = tcache.bins[i];
+        if (p != NULL) {
+            tcache.bins[i] = *(void **)p;
+            // the next malloc of this size reads the link in the new head
+            __builtin_prefetch(tcache.bins[i]);
+            tcache.counts[i]--;
+            tcache.hits++;
+            return tcache.touched = count_sample(p, size);
+        }
+        tcache.misses++;
+    }
+    lock_arena();
+    void *p = size <= SLAB_LIMIT ? slab_alloc(a, SLAB_CLASS(size)) : malloc_block(a, newsize);
+    unlock(&a->lock);
+    return tcache.touched = count_sample(p, size);
 }
 
+
 /*
- * mm_realloc - Free the block and allocate new space with some extra optimizations
+ * mm_free - Freeing a block and check if the two blocks next to it are free or not
+ * if so, combine these free blocks together and add the result to the list
+ * a block of another arena is handed over to the threads of that arena instead
  */
+void mm_free(void *ptr)
+{
+    if (ptr == NULL)
+        return;
+    tcache.touched = NULL;
+    if (__atomic_load_n(&num_samples, __ATOMIC_RELAXED) != 0)
+        forget_sample(ptr);
+    if (is_mapped(ptr)) {
+        map_free(ptr);
+        return;
+    }
+    arena_t *a = owner(ptr);
+    if (a != current_arena()) {
+        remote_free(a, ptr);
+        return;
+    }
+    // keep a slot or a small block in the cache, flushing its bin first if it is full
+    size_t i = TCACHE_BINS;
+    if (is_slab(ptr)) {
+        i = TCACHE_BLOCK_BINS + SLAB_OF(ptr)->cls;
+    } else {
+        size_t size = GET_SIZE(((char *)ptr) - WSIZE);
+        if (size < TCACHE_LIMIT)
+            i = TCACHE_INDEX(size);
+    }
+    if (i < TCACHE_BINS) {
+        if (tcache.counts[i] == TCACHE_DEPTH) {
+            lock_arena();
+            flush_bin(a, i);
+            unlock(&a->lock);
+        }
+        *(void **)ptr = tcache.bins[i];
+        tcache.bins[i] = ptr;
+        tcache.counts[i]++;
+        tcache.touched = ptr;
+        return;
+    }
+    lock_arena();
+#ifdef DEFERRED_COALESCING
+    // the block stays allocated on its quick list, unless the quick lists have just been coalesced
+    defer_free(a, ptr);
+    if (a->deferred != 0)
+        tcache.touched = ptr;
+#else
+    word_t *block = free_and_trim(a, ptr);
+    if (block != NULL)
+        tcache.touched = ((char *) block) + WSIZE;
+#endif
+    unlock(&a->lock);
+}
 
-void *mm_realloc(void *ptr, size_t size)
+// resize the payload at ptr for mm_realloc()
+static void *resize(void *ptr, size_t size)
 {
     // deal wtih some special cases
     if (ptr == NULL)
@@ -318,86 +1744,530 @@ void *mm_realloc(void *ptr, size_t size)
         mm_free(ptr);
         return NULL;
     }
+    if (size > HEAP_LIMIT)
+        return NULL;
 
-    // calculate the size of the orginal block and the new aligned size
-    size_t prev_size =  *(size_t *)(((char *)ptr) - SIZE_T_SIZE);
-    size_t newsize = ALIGN(size) + ALLOCATED_OVERHEAD_BLOCKS * SIZE_T_SIZE;
-
-    // record the information contained in the "next" "prev" blocks
-    // this is necessary because our implementation of free() will change these two blocks
-    long long temp1 =  *(long long *)ptr;
-    long long temp2 = *(((long long *)ptr) + 1);
+    // a block with a mapping of its own is remapped as long as it stays large
+    // since the threshold may have risen above it, it may also be growing when it is moved to the heap
+    if (is_mapped(ptr)) {
+        if (size >= mmap_threshold)
+            return map_realloc(ptr, size);
+        size_t old_payload = MAPPED_OF(ptr)->size - MAPPED_HEADER;
+        void *p = mm_malloc(size);
+        if (p == NULL)
+            return NULL;
+        if (size > old_payload)
+            size = old_payload;
+        memcpy(p, ptr, size);
+        tcache.copied += size;
+        map_free(ptr);
+        return p;
+    }
 
-    // deal with the special case when the block is at the end of the heap
-    // this optimization is for some test cases
-    if (((char *)ptr) + prev_size - SIZE_T_SIZE == ((char *) mem_heap_hi()) + 1) {
-        // when the size is enough, we do not change anything
-        if (newsize <= prev_size)
+    // a slot is kept if it is large enough, otherwise it is moved to a block or a larger slot
+    if (is_slab(ptr)) {
+        size_t slot = SLAB_OF(ptr)->size;
+        if (size <= slot)
             return ptr;
-        // when the size is not enough, add more size directly to the bottom of the heap
-        mem_sbrk(newsize - prev_size);
-        *(size_t *)(((char *)ptr) - SIZE_T_SIZE) = newsize;
-        *(size_t *)(((char *)ptr) - 2 * SIZE_T_SIZE + newsize) = newsize;
-        return ptr;
+        void *p = mm_malloc(size);
+        if (p == NULL)
+            return NULL;
+        memcpy(p, ptr, slot);
+        tcache.copied += slot;
+        mm_free(ptr);
+        return p;
     }
 
-    // when the ptr is not at the end of the heap
-    // simply free the block and allocate the space
-    // and then copy the original data
-    mm_free(ptr);
-
-    size_t i = find_index(newsize);
-
-    void *p = NULL;
+    // a block growing large enough is moved to a mapping of its own
+    if (size >= mmap_threshold) {
+        size_t old_payload = GET_SIZE(((char *)ptr) - WSIZE) - WSIZE;
+        void *p = map_alloc(size);
+        if (p == NULL)
+            return NULL;
+        memcpy(p, ptr, size < old_payload ? size : old_payload);
+        tcache.copied += size < old_payload ? size : old_payload;
+        mm_free(ptr);
+        return p;
+    }
 
-    while (i < SEGLIST_BLOCKS) {
-        if ((p = search(i, newsize)) != NULL) {
-            break;
-        }
-        i++;
+    arena_t *a = owner(ptr);
+    if (a == current_arena()) {
+        lock_arena();
+        void *p = realloc_block(a, ptr, size);
+        unlock(&a->lock);
+        return p;
     }
 
-    if (p != NULL) {
+    // the size in the top of an allocated block is not changed by its arena, so no lock is needed
+    size_t old_payload = GET_SIZE(((char *)ptr) - WSIZE) - WSIZE;
+    void *p = mm_malloc(size);
+    if (p == NULL)
+        return NULL;
+    memcpy(p, ptr, size < old_payload ? size : old_payload);
+    tcache.copied += size < old_payload ? size : old_payload;
+    remote_free(a, ptr);
+    return p;
+}
 
-        memmove(((char *)p) + 3 * SIZE_T_SIZE, ((char *)ptr) + 2 * SIZE_T_SIZE, prev_size > newsize ? newsize - 4 * SIZE_T_SIZE: prev_size - 4 * SIZE_T_SIZE);
+// resize the payload at ptr while the profiler is on: the old payload is no longer sampled, and the new one
+// is counted as a malloc of size bytes, rather than the mallocs resize() may make on its way
+static void *resize_sampled(void *ptr, size_t size) {
+    if (ptr != NULL)
+        forget_sample(ptr);
+    size_t left = tcache.sample_left;
+    void *p = resize(ptr, size);
+    if (p == NULL)
+        return NULL;
+    tcache.sample_left = left;
+    forget_sample(p);
+    return count_sample(p, size);
+}
 
+/*
+ * mm_realloc - Resize the block in place by splitting off its tail or taking its free neighbours,
+ * otherwise free it and allocate new space
+ * a block of another arena is moved to the arena of the current thread
+ */
 
-        split(p, newsize);
+void *mm_realloc(void *ptr, size_t size)
+{
+    // the block the request ends in is remembered for mm_check()
+    if (__atomic_load_n(&sample_period, __ATOMIC_RELAXED) != 0)
+        return tcache.touched = resize_sampled(ptr, size);
+    return tcache.touched = resize(ptr, size);
+}
 
-        p = (void *)(((char *)p) + SIZE_T_SIZE);
-        *(long long *)p = temp1;
-        *(((long long *)p) + 1) = temp2;
+/*
+ * mm_calloc - Allocate a payload of nmemb * size bytes which are all zero,
+ * without clearing it if the block was carved out of memory which mem_sbrk has just handed out
+ * for the first time or if it has a mapping of its own, since such memory reads as zeros
+ */
+void *mm_calloc(size_t nmemb, size_t size)
+{
+    size_t bytes;
+    if (__builtin_mul_overflow(nmemb, size, &bytes))
+        return NULL;
+    tcache.fresh = NULL;
+    char *p = mm_malloc(bytes);
+    if (p != NULL && !is_mapped(p) && (tcache.fresh == NULL || p < tcache.fresh))
+        memset(p, 0, bytes);
+    return p;
+}
 
-        return p;
-    } else {
-        p = mem_sbrk(newsize);
+/*
+ * mm_memalign - Allocate a payload aligned to align, a power of two, from a larger block
+ * whose parts before and after the aligned payload are freed again
+ */
+void *mm_memalign(size_t align, size_t size)
+{
+    if (align == 0 || (align & (align - 1)) != 0 || align > HEAP_LIMIT || size > HEAP_LIMIT)
+        return NULL;
+    if (align <= ALIGNMENT)
+        return mm_malloc(size);
+    arena_t *a = current_arena();
+    lock_arena();
+    void *p = memalign_block(a, align, block_size(size));
+    unlock(&a->lock);
+    return tcache.touched = count_sample(p, size);
+}
 
-        if (p == (void *)-1)
-            return NULL;
-        else {
-            memmove(((char *)p) + 3 * SIZE_T_SIZE, ((char *)ptr) + 2 * SIZE_T_SIZE, prev_size > newsize ? newsize - 4 * SIZE_T_SIZE: prev_size - 4 * SIZE_T_SIZE);
-            *(size_t *)p = newsize;
-            *(size_t *)(((char *) p) + newsize - SIZE_T_SIZE) = newsize;
-            p = (void *)(((char *)p) + SIZE_T_SIZE);
-            *(long long *)p = temp1;
-            *(((long long *)p) + 1) = temp2;
+/*
+ * mm_usable_size - Return the number of bytes of the payload at ptr, which may be more than were asked for
+ */
+size_t mm_usable_size(void *ptr)
+{
+    if (ptr == NULL)
+        return 0;
+    if (is_mapped(ptr))
+        return MAPPED_OF(ptr)->size - MAPPED_HEADER;
+    if (is_slab(ptr))
+        return SLAB_OF(ptr)->size;
+    return GET_SIZE(((char *)ptr) - WSIZE) - WSIZE;
+}
 
-            return p;
+/*
+ * mm_malloc_batch - Allocate n payloads of the same size and store them in out, taking the cached blocks
+ * of the thread first, and cutting the rest out of as few blocks as BATCH_LIMIT allows under a single lock
+ * return the number of payloads allocated, which is less than n only if memory ran out
+ */
+size_t mm_malloc_batch(size_t size, size_t n, void **out)
+{
+    size_t k = 0;
+    if (size > HEAP_LIMIT) {
+        tcache.touched = NULL;
+        return 0;
+    }
+    if (size >= mmap_threshold) {
+        while (k < n && (out[k] = map_alloc(size)) != NULL)
+            count_sample(out[k++], size);
+        tcache.touched = k > 0 ? out[k - 1] : NULL;
+        return k;
+    }
+    size_t newsize = 0;
+    size_t i = TCACHE_BINS;
+    arena_t *a = current_arena();
+    if (size <= SLAB_LIMIT)
+        i = TCACHE_BLOCK_BINS + SLAB_CLASS(size);
+    else if ((newsize = block_size(size)) < TCACHE_LIMIT)
+        i = TCACHE_INDEX(newsize);
+    if (i < TCACHE_BINS) {
+        while (k < n && tcache.bins[i] != NULL) {
+            out[k++] = tcache.bins[i];
+            tcache.bins[i] = *(void **)tcache.bins[i];
+            tcache.counts[i]--;
+            tcache.hits++;
+        }
+        tcache.misses += n - k;
+    }
+    if (k < n) {
+        lock_arena();
+        if (size <= SLAB_LIMIT) {
+            while (k < n && (out[k] = slab_alloc(a, SLAB_CLASS(size))) != NULL)
+                k++;
+        } else {
+            size_t per_block = newsize < BATCH_LIMIT ? BATCH_LIMIT / newsize : 1;
+            while (k < n) {
+                size_t m = malloc_blocks(a, newsize, n - k < per_block ? n - k : per_block, out + k);
+                if (m == 0)
+                    break;
+                k += m;
+            }
         }
+        unlock(&a->lock);
     }
+    for (size_t j = 0; j < k; j++)
+        count_sample(out[j], size);
+    tcache.touched = k > 0 ? out[k - 1] : NULL;
+    return k;
 }
 
+// order payloads by address for qsort()
+static int compare_payloads(const void *x, const void *y) {
+    size_t p = (size_t) *(void * const *) x, q = (size_t) *(void * const *) y;
+    return (p > q) - (p < q);
+}
 
+/*
+ * mm_free_batch - Free n payloads, which are sorted by address in place, so that every run of adjacent blocks
+ * of the arena of the thread is merged into one block, which is coalesced with its neighbours once
+ * the blocks skip the cache of the thread, and those of other arenas are handed over to them one by one
+ */
+void mm_free_batch(void **ptrs, size_t n)
+{
+    tcache.touched = NULL;
+    if (__atomic_load_n(&num_samples, __ATOMIC_RELAXED) != 0)
+        for (size_t j = 0; j < n; j++)
+            if (ptrs[j] != NULL)
+                forget_sample(ptrs[j]);
+    qsort(ptrs, n, sizeof(void *), compare_payloads);
+    arena_t *a = current_arena();
+    int locked = 0;
+    size_t j = 0;
+    while (j < n) {
+        void *ptr = ptrs[j++];
+        if (ptr == NULL)
+            continue;
+        if (is_mapped(ptr)) {
+            map_free(ptr);
+            continue;
+        }
+        arena_t *b = owner(ptr);
+        if (b != a) {
+            remote_free(b, ptr);
+            continue;
+        }
+        if (!locked) {
+            lock_arena();
+            locked = 1;
+        }
+        if (is_slab(ptr)) {
+            slab_free(a, ptr);
+            continue;
+        }
+        // the allocated blocks right after this one which are freed as well are merged into it
+        word_t *block = (word_t *)(((char *) ptr) - WSIZE);
+        while (j < n && !is_free(block) && ptrs[j] == ((char *) NEXT_BLOCK(block)) + WSIZE &&
+               !is_slab(ptrs[j]) && !is_free(NEXT_BLOCK(block))) {
+            *block = (GET_SIZE(block) + GET_SIZE(NEXT_BLOCK(block))) | IS_PREV_ALLOC(block);
+            a->stats.alloc_blocks--;
+            j++;
+        }
+        word_t *freed = free_and_trim(a, ptr);
+        if (freed != NULL)
+            tcache.touched = ((char *) freed) + WSIZE;
+    }
+    if (locked)
+        unlock(&a->lock);
+}
 
+/*
+ * mm_sbrk - Extend the heap by size bytes for memory which the package does not manage, like the chunks
+ * of regions (see region.c), under the lock the arenas take around mem_sbrk
+ * with several arenas, size must be a multiple of CHUNK_SIZE, so that every segment still starts at a chunk
+ * return the start of the new memory, or NULL on failure
+ */
+void *mm_sbrk(size_t size)
+{
+    if (num_arenas > 1 && (size & (CHUNK_SIZE - 1)) != 0)
+        return NULL;
+    void *p = NULL;
+    lock(&sbrk_lock);
+    char *brk = ((char *) mem_heap_hi()) + 1;
+    if ((size_t)(brk - heap_lo) + size <= HEAP_LIMIT) {
+        p = mem_sbrk((intptr_t) size);
+        if (p == (void *) -1)
+            p = NULL;
+    }
+    unlock(&sbrk_lock);
+    return p;
+}
 
+// a snapshot being written by mm_dump_snapshot(), whose bytes are buffered and written to fd when the buffer fills up
+typedef struct {
+    int fd;
+    int failed;                     // set once a write fails
+    unsigned char *end;             // the end of the buffered bytes
+    unsigned char buf[4096];
+} snapshot_t;
+
+// write the buffered bytes of a snapshot
+static void flush_snapshot(snapshot_t *s) {
+    unsigned char *p = s->buf;
+    while (p < s->end && !s->failed) {
+        ssize_t n = write(s->fd, p, s->end - p);
+        if (n <= 0)
+            s->failed = 1;
+        else
+            p += n;
+    }
+    s->end = s->buf;
+}
 
+// add a varint to a snapshot
+static void put_snapshot(snapshot_t *s, unsigned long v) {
+    if (s->end + VARINT_MAX > s->buf + sizeof(s->buf))
+        flush_snapshot(s);
+    s->end = put_varint(s->end, v);
+}
 
+// add the blocks of every segment of an arena, whose lock is held, to a snapshot
+static void snapshot_arena(snapshot_t *s, arena_t *a) {
+    for (void **seg = a->segments; seg != NULL; seg = *seg) {
+        word_t *p = (word_t *)(((char *) seg) + SEGMENT_HEAD);
+        put_snapshot(s, SNAP_SEGMENT);
+        put_snapshot(s, ((char *) p) - heap_lo);
+        for (; GET_SIZE(p) != 0; p = NEXT_BLOCK(p)) {
+            slab_t *slab = (slab_t *)(p + 1);
+            if (is_free(p)) {
+                put_snapshot(s, GET_SIZE(p) | SNAP_FREE);
+            } else if (is_slab(slab)) {
+                put_snapshot(s, GET_SIZE(p) | SNAP_SLAB);
+                put_snapshot(s, slab->size);
+                put_snapshot(s, slab->slots);
+                put_snapshot(s, slab->used);
+            } else {
+                put_snapshot(s, GET_SIZE(p) | SNAP_ALLOC);
+            }
+        }
+        put_snapshot(s, 0);
+    }
+}
 
+/*
+ * mm_dump_snapshot - Write every block of the heap and every sampled payload to fd in the format of heapsnap.h,
+ * holding the locks of all the arenas, so that the snapshot is taken at a single moment
+ * return 0, or -1 if a write failed
+ */
+int mm_dump_snapshot(int fd)
+{
+    snapshot_t s;
+    s.fd = fd;
+    s.failed = 0;
+    memcpy(s.buf, HEAPSNAP_MAGIC, HEAPSNAP_MAGIC_LEN);
+    s.end = s.buf + HEAPSNAP_MAGIC_LEN;
+    for (int i = 0; i < num_arenas; i++)
+        lock(&arenas[i].lock);
+    lock(&map_lock);
+    lock(&sample_lock);
+    put_snapshot(&s, ((char *) mem_heap_hi()) + 1 - heap_lo);
+    put_snapshot(&s, sample_period);
+    put_snapshot(&s, tcache.site);
+    put_snapshot(&s, num_arenas);
+    for (int i = 0; i < num_arenas; i++)
+        snapshot_arena(&s, &arenas[i]);
+    for (mapped_t *m = mapped; m != NULL; m = m->next) {
+        put_snapshot(&s, SNAP_MAPPED);
+        put_snapshot(&s, m->size);
+    }
+    for (size_t i = 0; i < SAMPLE_SLOTS && num_samples != 0; i++) {
+        char *ptr = samples[i].ptr;
+        if (ptr == NULL)
+            continue;
+        put_snapshot(&s, SNAP_SAMPLE);
+        if (is_mapped(ptr)) {
+            put_snapshot(&s, 0);
+            put_snapshot(&s, MAPPED_OF(ptr)->size);
+        } else {
+            put_snapshot(&s, ptr - heap_lo);
+            put_snapshot(&s, is_slab(ptr) ? SLAB_OF(ptr)->size : GET_SIZE(ptr - WSIZE));
+        }
+        put_snapshot(&s, samples[i].size);
+        put_snapshot(&s, samples[i].site);
+        put_snapshot(&s, samples[i].hits);
+    }
+    put_snapshot(&s, SNAP_END);
+    unlock(&sample_lock);
+    unlock(&map_lock);
+    for (int i = num_arenas - 1; i >= 0; i--)
+        unlock(&arenas[i].lock);
+    flush_snapshot(&s);
+    return s.failed ? -1 : 0;
+}
 
+/*
+ * The heap consistency checker. Every check prints what is wrong and returns 0 if it fails,
+ * so that mm_check() stops at the first problem it finds.
+ */
 
+// report a problem found at the block or node p
+static int corrupt(const char *what, word_t *p) {
+    printf("mm_check: %s at offset %lu\n", what, (unsigned long)(((char *) p) - heap_lo));
+    return 0;
+}
 
+// check that a free block is linked into the list of its size or the tree,
+// and that its neighbours in there point back to it
+static int check_links(arena_t *a, word_t *p) {
+    size_t i = find_index(GET_SIZE(p));
+    if (i == SEGLIST_BLOCKS) {
+        word_t *parent = PARENT(p);
+        if (parent == NULL ? TREE_ROOT(a) != p : LEFT_CHILD(parent) != p && RIGHT_CHILD(parent) != p)
+            return corrupt("tree node not linked from its parent", p);
+        if ((LEFT_CHILD(p) != NULL && PARENT(LEFT_CHILD(p)) != p) ||
+            (RIGHT_CHILD(p) != NULL && PARENT(RIGHT_CHILD(p)) != p))
+            return corrupt("tree node not the parent of its children", p);
+        return 1;
+    }
+    word_t *prev = PREV_NODE_ADDRESS(p);
+    word_t *next = NEXT_NODE_ADDRESS(p);
+    if (prev == NULL ? GET_HEAD(a, i) != p : NEXT_NODE_ADDRESS(prev) != p)
+        return corrupt("list node not linked from the node before it", p);
+    if (next != NULL && PREV_NODE_ADDRESS(next) != p)
+        return corrupt("list node not linked from the node after it", p);
+    return 1;
+}
 
+// check a block against its neighbours: its size, the top and the bottom of a free block,
+// the bit of the previous block in the top of the next one, and the links of a free block
+// no two free blocks are adjacent, since free blocks are always coalesced
+static int check_block(arena_t *a, word_t *p) {
+    size_t size = GET_SIZE(p);
+    char *hi = mem_heap_hi();
+    if (size < MIN_BLOCK_SIZE || size % ALIGNMENT != 0 || ((char *) p) + size + WSIZE > hi + 1)
+        return corrupt("block of a bad size", p);
+    word_t *next = NEXT_BLOCK(p);
+    if (!is_free(p))
+        return IS_PREV_ALLOC(next) ? 1 : corrupt("allocated block not marked so in the next block", p);
+    if (WORD(p, size / WSIZE - 1) != (size | FREE_BIT))
+        return corrupt("free block whose top and bottom differ", p);
+    if (!IS_PREV_ALLOC(p))
+        return corrupt("free block after a free block", p);
+    if (is_free(next) || IS_PREV_ALLOC(next))
+        return corrupt("free block not marked so in the next block", p);
+    return check_links(a, p);
+}
 
+// check the block the last request of the current thread ended in, and the blocks next to it
+// that is the page of a slot, and a block with a mapping of its own is not checked
+static int check_touched(void) {
+    char *ptr = tcache.gen == heap_gen ? tcache.touched : NULL;
+    if (ptr == NULL || is_mapped(ptr))
+        return 1;
+    word_t *p = (word_t *)((is_slab(ptr) ? (char *) SLAB_OF(ptr) : ptr) - WSIZE);
+    arena_t *a = owner(ptr);
+    lock(&a->lock);
+    int ok = check_block(a, p);
+    if (ok && GET_SIZE(NEXT_BLOCK(p)) != 0)
+        ok = check_block(a, NEXT_BLOCK(p));
+    if (ok && !IS_PREV_ALLOC(p))
+        ok = check_block(a, PREV_BLOCK(p));
+    unlock(&a->lock);
+    return ok;
+}
 
+// check the order, the priorities and the parents of the subtree at p, and count its nodes
+// every node must be a free block which belongs in the tree
+static int check_tree(word_t *p, word_t *parent, size_t *n) {
+    if (p == NULL)
+        return 1;
+    if (!is_free(p) || find_index(GET_SIZE(p)) != SEGLIST_BLOCKS)
+        return corrupt("tree node which is not a large free block", p);
+    if (PARENT(p) != parent)
+        return corrupt("tree node with a wrong parent", p);
+    if (parent != NULL && PRIORITY(p) > PRIORITY(parent))
+        return corrupt("tree node of a higher priority than its parent", p);
+    word_t *l = LEFT_CHILD(p), *r = RIGHT_CHILD(p);
+    if ((l != NULL && compare(GET_SIZE(l), l, p) >= 0) || (r != NULL && compare(GET_SIZE(r), r, p) <= 0))
+        return corrupt("tree node out of order", p);
+    (*n)++;
+    return check_tree(l, p, n) && check_tree(r, p, n);
+}
 
+// walk every segment of an arena, whose lock is held, checking each block,
+// then check that the lists and the tree hold exactly the free blocks found
+static int check_arena(arena_t *a) {
+    size_t blocks = 0, bytes = 0, nodes = 0;
+    for (void **seg = a->segments; seg != NULL; seg = *seg) {
+        word_t *p = (word_t *)(((char *) seg) + SEGMENT_HEAD);
+        while (GET_SIZE(p) != 0) {
+            if (!check_block(a, p))
+                return 0;
+            if (is_free(p)) {
+                blocks++;
+                bytes += GET_SIZE(p);
+            }
+            p = NEXT_BLOCK(p);
+        }
+        if (is_free(p))
+            return corrupt("free epilogue", p);
+    }
+    // a node in a list of the wrong size, or in a cycle, would be counted more than once
+    for (size_t i = 0; i < SEGLIST_BLOCKS; i++) {
+        for (word_t *p = GET_HEAD(a, i); p != NULL; p = NEXT_NODE_ADDRESS(p)) {
+            if (!is_free(p) || find_index(GET_SIZE(p)) != i)
+                return corrupt("list node which is not a free block of its size", p);
+            if (++nodes > blocks)
+                return corrupt("more nodes in the lists than free blocks, last", p);
+        }
+        if ((GET_HEAD(a, i) != NULL) != ((a->nonempty >> i) & 1))
+            return corrupt("wrong bit of a list in nonempty for the arena", (word_t *) a);
+    }
+    if (!check_tree(TREE_ROOT(a), NULL, &nodes))
+        return 0;
+    if ((TREE_ROOT(a) != NULL) != ((a->nonempty >> SEGLIST_BLOCKS) & 1))
+        return corrupt("wrong bit of the tree in nonempty for the arena", (word_t *) a);
+    if (nodes != blocks)
+        return corrupt("free blocks missing from the lists and the tree of the arena", (word_t *) a);
+    if (a->stats.free_blocks != blocks || a->stats.free_bytes != bytes)
+        return corrupt("wrong counts of free blocks for the arena", (word_t *) a);
+    return 1;
+}
 
+/*
+ * mm_check - check the consistency of the heap, and return 0 if it is consistent, otherwise -1
+ * the incremental mode only checks the block the last request of the thread ended in and its
+ * neighbours, while the full mode walks every segment and every list of every arena
+ */
+int mm_check(int full)
+{
+    if (!full)
+        return check_touched() ? 0 : -1;
+    for (int i = 0; i < num_arenas; i++) {
+        lock(&arenas[i].lock);
+        int ok = check_arena(&arenas[i]);
+        unlock(&arenas[i].lock);
+        if (!ok)
+            return -1;
+    }
+    return 0;
+}
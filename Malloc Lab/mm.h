@@ -5,6 +5,98 @@ extern void *mm_malloc (size_t size);
 extern void mm_free (void *ptr);
 extern void *mm_realloc(void *ptr, size_t size);
 
+/*
+ * A payload of nmemb * size bytes cleared to zero, a payload aligned to
+ * align, which must be a power of two, and the number of bytes a payload
+ * really has, which may be more than were asked for, as needed by calloc,
+ * posix_memalign and malloc_usable_size (see preload.c)
+ */
+extern void *mm_calloc(size_t nmemb, size_t size);
+extern void *mm_memalign(size_t align, size_t size);
+extern size_t mm_usable_size(void *ptr);
+
+/*
+ * n payloads of size bytes each stored in out, taken out of a single
+ * free block or heap extension, which returns how many were allocated
+ * (fewer than n only if memory ran out), and the freeing of n payloads
+ * at once, which sorts ptrs by address in place so that adjacent blocks
+ * are coalesced together
+ */
+extern size_t mm_malloc_batch(size_t size, size_t n, void **out);
+extern void mm_free_batch(void **ptrs, size_t n);
+
+/*
+ * Free blocks are counted in size classes, the k-th of which holds the
+ * blocks of 2^(k+4) up to 2^(k+5)-1 bytes, and the last one all larger blocks
+ */
+#define MM_FREE_CLASSES 16
+
+/*
+ * Counters describing the allocated and free blocks in the heap, which
+ * are maintained by the malloc package and reported by mm_stats, which
+ * is cheap enough to be called while a program runs
+ */
+typedef struct {
+    size_t alloc_blocks;    /* number of allocated blocks */
+    size_t alloc_bytes;     /* total size of allocated blocks, overheads included */
+    size_t tcache_hits;     /* small mallocs served by the cache of a thread */
+    size_t tcache_misses;   /* small mallocs which were not */
+    size_t realloc_copied;  /* payload bytes copied by reallocs which moved a block */
+    size_t free_blocks;     /* number of free blocks which mallocs can take */
+    size_t free_bytes;      /* total size of those free blocks */
+    size_t free_class_bytes[MM_FREE_CLASSES]; /* ... and in each size class */
+    size_t largest_free;    /* size of the largest free block */
+    double ext_frag;        /* external fragmentation, 1 - largest_free / free_bytes */
+    size_t searches;        /* searches of the free blocks for a fit */
+    size_t search_steps;    /* free blocks looked at by those searches */
+} mm_stats_t;
+
+extern void mm_stats(mm_stats_t *stats);
+
+/*
+ * The sampling heap profiler: once every period bytes allocated, the
+ * payload that byte falls in is recorded with the bytes requested and
+ * the site last set by the allocating thread with mm_set_site (mdriver
+ * sets the index of the request), until it is freed. A period of 0, the
+ * default, turns it off. mm_dump_snapshot writes every block of the heap
+ * and the recorded payloads to fd in the format of heapsnap.h, which
+ * snapreport reads, and returns 0, or -1 if a write failed.
+ */
+extern void mm_set_sample_period(size_t period);
+extern void mm_set_site(unsigned int site);
+extern int mm_dump_snapshot(int fd);
+
+/*
+ * Extends the heap by size bytes which the package leaves alone, for
+ * allocators layered on it such as the regions of region.h, and returns
+ * their start or NULL. With several arenas, size must be a multiple of
+ * MM_CHUNK_SIZE, the unit the arenas share the heap in.
+ */
+#define MM_CHUNK_SIZE (64 * 1024)
+extern void *mm_sbrk(size_t size);
+
+/*
+ * Checks the consistency of the heap and returns 0 if it is consistent,
+ * otherwise it prints the first problem found and returns -1. Unless full
+ * is set, only the block the last request of the calling thread ended in
+ * and its neighbours are checked, which is cheap enough to do after every
+ * request. The full mode walks the whole heap and checks that the free
+ * blocks are exactly those in the free lists.
+ */
+extern int mm_check(int full);
+
+/*
+ * The package is thread-safe. Threads are spread over n arenas, which
+ * takes effect at the next call to mm_init (the default is one arena)
+ */
+extern void mm_set_arenas(int n);
+
+/*
+ * Payloads of at least size bytes get mappings of their own outside the
+ * heap (the default is 128KB, and 0 turns them off)
+ */
+extern void mm_set_mmap_threshold(size_t size);
+
 
 /* 
  * Students work in teams of one or two.  Teams enter their team name, 
@@ -0,0 +1,276 @@
+/*
+ * osmem.c - the functions of memlib.h on real memory, for mm.c when it
+ *           is the malloc of a process (see preload.c). The heap is an
+ *           address range reserved with no access whose pages are made
+ *           accessible as the brk grows, and mem_map is plain mmap.
+ *
+ *           Unlike memlib.c, nothing here may call malloc, which would
+ *           come back into mm.c, so the mappings are not recorded and
+ *           mem_in_heap only knows about the heap.
+ */
+#define _GNU_SOURCE /* for mremap */
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+
+#include "memlib.h"
+#include "config.h"
+
+/* the heap grows in steps of this many bytes of accessible pages */
+#define GROW_STEP (1UL << 20)
+
+/* private variables */
+static char *mem_start_brk;  /* points to first byte of heap */
+static char *mem_brk;        /* points to last byte of heap */
+static char *mem_max_addr;   /* largest legal heap address */
+static char *mem_open_brk;   /* the pages below it are accessible */
+static char *mem_used_brk;   /* highest brk ever, no byte above it was written */
+static size_t mem_mapped;    /* bytes of the mappings made by mem_map */
+static size_t mem_peak;      /* largest heap size */
+static int mem_count_mapped = 1; /* whether mappings count in the heap size */
+
+/*
+ * update_peak - record the current heap size if it is the largest yet
+ */
+static void update_peak(void)
+{
+    size_t size = mem_heapsize();
+    size_t peak = __atomic_load_n(&mem_peak, __ATOMIC_RELAXED);
+
+    while (size > peak &&
+	   !__atomic_compare_exchange_n(&mem_peak, &peak, size, 1,
+					__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+	;
+}
+
+/*
+ * mem_init - reserve the address space of the heap, without any access
+ *    to it, so that it takes neither memory nor swap until it is used
+ */
+void mem_init(void)
+{
+    mem_start_brk = (char *)mmap(NULL, MAX_HEAP, PROT_NONE,
+				 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (mem_start_brk == MAP_FAILED) {
+	mem_start_brk = NULL;
+	return;
+    }
+    mem_max_addr = mem_start_brk + MAX_HEAP;
+    mem_brk = mem_start_brk;
+    mem_open_brk = mem_start_brk;
+    mem_used_brk = mem_start_brk;
+}
+
+/*
+ * mem_deinit - unmap the heap
+ */
+void mem_deinit(void)
+{
+    munmap(mem_start_brk, MAX_HEAP);
+}
+
+/*
+ * mem_reset_brk - make an empty heap, whose pages are given back
+ */
+void mem_reset_brk()
+{
+    mem_release(mem_start_brk, mem_brk);
+    mem_brk = mem_start_brk;
+}
+
+/*
+ * mem_sbrk - extend the heap by incr bytes and return the start address
+ *    of the new area, making whole steps of pages accessible as needed.
+ *    A negative incr shrinks the heap, and the whole pages it gives up
+ *    are released. The caller serializes the calls.
+ */
+void *mem_sbrk(intptr_t incr)
+{
+    char *old_brk = mem_brk;
+
+    if (mem_start_brk == NULL ||
+	(mem_brk + incr) > mem_max_addr || (mem_brk + incr) < mem_start_brk) {
+	errno = ENOMEM;
+	return (void *)-1;
+    }
+    if (mem_brk + incr > mem_open_brk) {
+	char *open = mem_start_brk +
+	    ((mem_brk + incr - mem_start_brk + GROW_STEP - 1) & ~(GROW_STEP - 1));
+	if (open > mem_max_addr)
+	    open = mem_max_addr;
+	if (mprotect(mem_open_brk, open - mem_open_brk, PROT_READ | PROT_WRITE) != 0) {
+	    errno = ENOMEM;
+	    return (void *)-1;
+	}
+	mem_open_brk = open;
+    }
+    /* other threads read the brk through mem_heap_hi without the lock */
+    __atomic_store_n(&mem_brk, mem_brk + incr, __ATOMIC_RELEASE);
+    if (incr < 0)
+	mem_release(mem_brk, old_brk);
+    update_peak();
+    if (mem_brk > mem_used_brk)
+	__atomic_store_n(&mem_used_brk, mem_brk, __ATOMIC_RELAXED);
+    return (void *)old_brk;
+}
+
+/*
+ * mem_release - give the whole pages between lo and hi back to the
+ *    system. They stay accessible and read as zeros the next time, so
+ *    if they reach the bytes which were never written, those start at
+ *    lo now.
+ */
+void mem_release(void *lo, void *hi)
+{
+    size_t pagesize = mem_pagesize();
+    char *start = (char *)(((size_t)lo + pagesize - 1) & ~(pagesize - 1));
+    char *end = (char *)((size_t)hi & ~(pagesize - 1));
+    char *untouched = (char *)mem_untouched();
+
+    if (start < end) {
+	madvise(start, end - start, MADV_DONTNEED);
+	if (end >= untouched && start < untouched)
+	    __atomic_store_n(&mem_used_brk, start, __ATOMIC_RELAXED);
+    }
+}
+
+/*
+ * mem_untouched - return the address from which no byte of the heap
+ *    has been written, so that memory taken from there by mem_sbrk
+ *    reads as zeros
+ */
+void *mem_untouched(void)
+{
+    return __atomic_load_n(&mem_used_brk, __ATOMIC_RELAXED);
+}
+
+/*
+ * mem_map - map size bytes outside of the heap. Returns NULL on failure.
+ */
+void *mem_map(size_t size)
+{
+    void *p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (p == MAP_FAILED)
+	return NULL;
+    __atomic_add_fetch(&mem_mapped, size, __ATOMIC_RELAXED);
+    update_peak();
+    return p;
+}
+
+/*
+ * mem_unmap - unmap size bytes mapped by mem_map at p
+ */
+void mem_unmap(void *p, size_t size)
+{
+    munmap(p, size);
+    __atomic_sub_fetch(&mem_mapped, size, __ATOMIC_RELAXED);
+}
+
+/*
+ * mem_remap - resize a mapping made by mem_map from old_size to
+ *    new_size bytes, moving it if needed. Returns the new address or
+ *    NULL on failure.
+ */
+void *mem_remap(void *p, size_t old_size, size_t new_size)
+{
+    void *q = mremap(p, old_size, new_size, MREMAP_MAYMOVE);
+
+    if (q == MAP_FAILED)
+	return NULL;
+    if (new_size > old_size)
+	__atomic_add_fetch(&mem_mapped, new_size - old_size, __ATOMIC_RELAXED);
+    else
+	__atomic_sub_fetch(&mem_mapped, old_size - new_size, __ATOMIC_RELAXED);
+    update_peak();
+    return q;
+}
+
+/*
+ * mem_in_heap - check if the bytes from lo to hi (inclusive) lie in the
+ *    heap; the mappings made by mem_map are not recorded
+ */
+int mem_in_heap(void *lo, void *hi)
+{
+    return (char *)lo >= mem_start_brk && (char *)hi < mem_brk;
+}
+
+/*
+ * mem_set_count_mapped - choose whether the mappings made by mem_map
+ *    count in the heap size along with the brk heap (the default)
+ */
+void mem_set_count_mapped(int on)
+{
+    mem_count_mapped = on;
+}
+
+/*
+ * mem_heap_lo - return address of the first heap byte
+ */
+void *mem_heap_lo()
+{
+    return (void *)mem_start_brk;
+}
+
+/*
+ * mem_heap_hi - return address of last heap byte
+ */
+void *mem_heap_hi()
+{
+    return (void *)(__atomic_load_n(&mem_brk, __ATOMIC_ACQUIRE) - 1);
+}
+
+/*
+ * mem_heapsize() - returns the heap size in bytes, including the
+ *    mappings made by mem_map unless mem_set_count_mapped(0) was called
+ */
+size_t mem_heapsize()
+{
+    size_t size = (size_t)(mem_brk - mem_start_brk);
+
+    if (mem_count_mapped)
+	size += __atomic_load_n(&mem_mapped, __ATOMIC_RELAXED);
+    return size;
+}
+
+/*
+ * mem_peak_heapsize() - returns the largest heap size in bytes
+ */
+size_t mem_peak_heapsize()
+{
+    return mem_peak;
+}
+
+/*
+ * mem_rss() - returns the number of bytes of the heap which are resident,
+ *    counting the mappings made by mem_map as resident if they count in
+ *    the heap size
+ */
+size_t mem_rss()
+{
+    size_t pagesize = mem_pagesize();
+    size_t npages = (mem_open_brk - mem_start_brk) / pagesize;
+    size_t resident = 0;
+    size_t i, j, n;
+    unsigned char vec[4096];
+
+    for (i = 0; i < npages; i += n) {
+	n = npages - i < sizeof(vec) ? npages - i : sizeof(vec);
+	if (mincore(mem_start_brk + i * pagesize, n * pagesize, vec) != 0)
+	    break;
+	for (j = 0; j < n; j++)
+	    resident += vec[j] & 1;
+    }
+    if (mem_count_mapped)
+	resident += __atomic_load_n(&mem_mapped, __ATOMIC_RELAXED) / pagesize;
+    return resident * pagesize;
+}
+
+/*
+ * mem_pagesize() - returns the page size of the system
+ */
+size_t mem_pagesize()
+{
+    return (size_t)getpagesize();
+}
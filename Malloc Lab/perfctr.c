@@ -0,0 +1,141 @@
+/*
+ * perfctr.c - Count hardware events with perf_event_open(2)
+ *
+ * Every event gets a counter of its own rather than a group, so that
+ * the events a machine does not support, or which the kernel does not
+ * permit (see /proc/sys/kernel/perf_event_paranoid), are simply left
+ * out. Only user-space events of the calling thread are counted. When
+ * the kernel multiplexes the counters, each count is scaled up by the
+ * fraction of the time its counter was running.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "perfctr.h"
+
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+/* the type and the config of each event */
+#define CACHE_MISS(cache) \
+    ((cache) | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16))
+
+static struct {
+    const char *name;
+    unsigned type;
+    unsigned long long config;
+} events[PERF_EVENTS] = {
+    {"instrs", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {"L1Dmiss", PERF_TYPE_HW_CACHE, CACHE_MISS(PERF_COUNT_HW_CACHE_L1D)},
+    {"LLCmiss", PERF_TYPE_HW_CACHE, CACHE_MISS(PERF_COUNT_HW_CACHE_LL)},
+    {"brmiss", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+    {"TLBmiss", PERF_TYPE_HW_CACHE, CACHE_MISS(PERF_COUNT_HW_CACHE_DTLB)},
+};
+
+static int fds[PERF_EVENTS] = {-1, -1, -1, -1, -1};
+
+/*
+ * perf_init - Open a counter for each event, disabled until perf_start
+ */
+int perf_init(void)
+{
+    struct perf_event_attr attr;
+    int i, n = 0;
+
+    for (i = 0; i < PERF_EVENTS; i++) {
+	if (fds[i] >= 0) {
+	    n++;
+	    continue;
+	}
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = events[i].type;
+	attr.config = events[i].config;
+	attr.disabled = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | 
+	    PERF_FORMAT_TOTAL_TIME_RUNNING;
+	fds[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+	if (fds[i] >= 0)
+	    n++;
+    }
+    return n;
+}
+
+/*
+ * perf_start - Reset the open counters and start them
+ */
+void perf_start(void)
+{
+    int i;
+
+    for (i = 0; i < PERF_EVENTS; i++)
+	if (fds[i] >= 0) {
+	    ioctl(fds[i], PERF_EVENT_IOC_RESET, 0);
+	    ioctl(fds[i], PERF_EVENT_IOC_ENABLE, 0);
+	}
+}
+
+/*
+ * perf_stop - Stop the open counters and read them, scaling each 
+ *     count up if its counter was not running all the time
+ */
+void perf_stop(double counts[PERF_EVENTS])
+{
+    unsigned long long v[3]; /* value, time enabled, time running */
+    int i;
+
+    for (i = 0; i < PERF_EVENTS; i++)
+	if (fds[i] >= 0)
+	    ioctl(fds[i], PERF_EVENT_IOC_DISABLE, 0);
+    for (i = 0; i < PERF_EVENTS; i++) {
+	counts[i] = 0;
+	if (fds[i] >= 0 && read(fds[i], v, sizeof(v)) == sizeof(v) && v[2] != 0)
+	    counts[i] = (double)v[0] * v[1] / v[2];
+    }
+}
+
+#else /* no perf_event_open, so no event is ever counted */
+
+static struct {
+    const char *name;
+} events[PERF_EVENTS] = {
+    {"instrs"}, {"L1Dmiss"}, {"LLCmiss"}, {"brmiss"}, {"TLBmiss"}
+};
+
+static int fds[PERF_EVENTS] = {-1, -1, -1, -1, -1};
+
+int perf_init(void)
+{
+    return 0;
+}
+
+void perf_start(void)
+{
+}
+
+void perf_stop(double counts[PERF_EVENTS])
+{
+    memset(counts, 0, PERF_EVENTS * sizeof(double));
+}
+
+#endif /* __linux__ */
+
+/*
+ * perf_name - The name of the i-th event, as a column heading
+ */
+const char *perf_name(int i)
+{
+    return events[i].name;
+}
+
+/*
+ * perf_available - Return true if the counter of the i-th event is open
+ */
+int perf_available(int i)
+{
+    return fds[i] >= 0;
+}
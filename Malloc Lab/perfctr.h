@@ -0,0 +1,17 @@
+/*
+ * Hardware performance counters
+ */
+#define PERF_EVENTS 5  /* instructions, L1D, LLC, branch and dTLB misses */
+
+/* Open a counter for each event and return how many could be opened. 
+   An event which is not permitted or not supported is left out. */
+int perf_init(void);
+
+/* The name of the i-th event, and whether its counter is open */
+const char *perf_name(int i);
+int perf_available(int i);
+
+/* Count the events of the calling thread from perf_start until 
+   perf_stop, which stores the counts of the open counters in counts */
+void perf_start(void);
+void perf_stop(double counts[PERF_EVENTS]);
@@ -0,0 +1,157 @@
+#!/usr/bin/env python3
+#
+# preload-bench.py - Runs a workload with the malloc of glibc and with
+#     mm.c through LD_PRELOAD (see preload.c), several times each, and
+#     compares their wall time, CPU time and peak RSS (VmHWM in
+#     /proc/<pid>/status, so Linux only).
+#
+#     usage: ./preload-bench.py [-n runs] [-l libmm.so] -- command ...
+#            ./preload-bench.py [-n runs] [-l libmm.so] -s server
+#                [-w secs] -- command ...
+#
+#     Without -s, the command itself is the workload, for example
+#
+#         ./preload-bench.py -n 5 -- python3 -c "import json; json.dumps([str(i) * 10 for i in range(10**6)])"
+#
+#     With -s, the server (a shell command, which should exec the server
+#     so that it gets the signal) is started with each malloc, the command
+#     is run against it with the malloc of glibc -w seconds later, and the
+#     server is stopped with SIGTERM once the command is done. The time is
+#     that of the command and the CPU time and RSS those of the server:
+#
+#         ./preload-bench.py -s "exec '../Proxy Lab/proxy' 15213 >/dev/null" \
+#             -- sh -c 'for i in $(seq 2000); do
+#                 curl -s --proxy localhost:15213 http://localhost:8000/home.html; done >/dev/null'
+#
+#     where an origin server listens on port 8000.
+#
+import optparse
+import os
+import shutil
+import signal
+import statistics
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+#
+# preload_path - return a path to the library which LD_PRELOAD can hold,
+#     since it splits its value at spaces and colons
+#
+def preload_path(lib, tmpdir):
+    lib = os.path.abspath(lib)
+    if any(c in lib for c in " :"):
+        path = os.path.join(tmpdir, "libmm.so")
+        shutil.copy(lib, path)
+        return path
+    return lib
+
+#
+# peak_rss - return the peak RSS in KB of a running process, or 0 if it is
+#     gone. The ru_maxrss of wait4 is no good, since it keeps the RSS of
+#     this script, which the process had until it called exec
+#
+def peak_rss(pid):
+    try:
+        with open("/proc/%d/status" % pid) as f:
+            for line in f:
+                if line.startswith("VmHWM:"):
+                    return int(line.split()[1])
+    except OSError:
+        pass
+    return 0
+
+#
+# wait - wait for a process and return its CPU seconds and its peak RSS
+#     in KB, which is polled every 10 ms while it runs
+#
+def wait(proc):
+    rss = [0]
+    done = threading.Event()
+    def poll():
+        while not done.wait(0.01):
+            rss[0] = max(rss[0], peak_rss(proc.pid))
+    poller = threading.Thread(target=poll)
+    poller.start()
+    _, status, usage = os.wait4(proc.pid, 0)
+    done.set()
+    poller.join()
+    proc.returncode = os.waitstatus_to_exitcode(status)
+    return usage.ru_utime + usage.ru_stime, rss[0]
+
+#
+# run - run the workload once, with the environment env for the command
+#     or for the server, and return its wall seconds, CPU seconds and RSS;
+#     the command run against a server gets client_env
+#
+def run(opts, command, env, client_env):
+    if opts.server is None:
+        start = time.perf_counter()
+        proc = subprocess.Popen(command, env=env)
+        cpu, rss = wait(proc)
+        wall = time.perf_counter() - start
+        if proc.returncode != 0:
+            sys.exit("preload-bench: %s exited with %d" % (command[0], proc.returncode))
+        return wall, cpu, rss
+
+    server = subprocess.Popen(opts.server, shell=True, env=env)
+    time.sleep(opts.wait)
+    start = time.perf_counter()
+    status = subprocess.call(command, env=client_env)
+    wall = time.perf_counter() - start
+    rss = peak_rss(server.pid)
+    server.send_signal(signal.SIGTERM)
+    cpu, _ = wait(server)
+    if status != 0:
+        sys.exit("preload-bench: %s exited with %d" % (command[0], status))
+    return wall, cpu, rss
+
+#
+# main - Main function
+#
+def main():
+    p = optparse.OptionParser(usage="%prog [options] -- command ...")
+    p.add_option("-n", type="int", dest="runs", default=3,
+                 help="runs with each malloc (default 3)")
+    p.add_option("-l", dest="lib", default=os.path.join(os.path.dirname(
+                     os.path.abspath(__file__)), "libmm.so"),
+                 help="the library built by 'make libmm.so'")
+    p.add_option("-s", dest="server",
+                 help="shell command starting a server to run the command against")
+    p.add_option("-w", type="float", dest="wait", default=1.0,
+                 help="seconds the server is given to start (default 1)")
+    opts, command = p.parse_args()
+    if not command:
+        p.error("no command given")
+    if not os.path.exists(opts.lib):
+        sys.exit("preload-bench: %s not found, run 'make libmm.so'" % opts.lib)
+
+    tmpdir = tempfile.mkdtemp()
+    try:
+        glibc = dict(os.environ)
+        glibc.pop("LD_PRELOAD", None)
+        mm = dict(glibc, LD_PRELOAD=preload_path(opts.lib, tmpdir))
+
+        # the runs alternate, so that both see the same state of the machine
+        results = {"glibc": [], "mm": []}
+        for i in range(opts.runs):
+            results["glibc"].append(run(opts, command, glibc, glibc))
+            results["mm"].append(run(opts, command, mm, glibc))
+    finally:
+        shutil.rmtree(tmpdir)
+
+    print("%-6s %10s %10s %10s   (median of %d runs)"
+          % ("malloc", "secs", "cpu", "rssKB", opts.runs))
+    medians = {}
+    for name in ("glibc", "mm"):
+        medians[name] = [statistics.median(r[k] for r in results[name]) for k in range(3)]
+        print("%-6s %10.3f %10.3f %10d" % (name, medians[name][0],
+                                           medians[name][1], medians[name][2]))
+    g, m = medians["glibc"], medians["mm"]
+    print("%-6s %9.2fx %9.2fx %9.2fx" % ("mm/gl", m[0] / g[0],
+                                         m[1] / g[1] if g[1] else 0, m[2] / g[2]))
+
+if __name__ == "__main__":
+    main()
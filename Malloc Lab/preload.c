@@ -0,0 +1,161 @@
+/*
+ * preload.c - mm.c as the malloc of any dynamically linked program
+ *
+ * libmm.so is mm.c on the real memory of osmem.c, wrapped in the
+ * functions of the C library that hand out or take back heap memory,
+ * so that LD_PRELOAD puts it in place of the malloc of glibc:
+ *
+ *     unix> make libmm.so
+ *     unix> LD_PRELOAD=./libmm.so ls -l
+ *
+ * The heap is set up by the first call. MM_ARENAS in the environment
+ * sets the number of arenas (the default is the number of processors).
+ * A request for more than the heap can hold, like malloc(SIZE_MAX),
+ * fails with ENOMEM, since mm.c refuses it before rounding its size.
+ *
+ * Everything else in the library is hidden, so that a program with an
+ * mm.c of its own, like mdriver, still calls its own and the wrappers
+ * still call this one. A program which forks while another of its
+ * threads is in malloc may find the lock of an arena held in the child.
+ */
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "mm.h"
+#include "memlib.h"
+
+#define EXPORT __attribute__((visibility("default")))
+
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+static int ready;
+
+/*
+ * init - set up the heap of the process, which is never given back
+ */
+static void init(void)
+{
+    char *arenas = getenv("MM_ARENAS");
+
+    mem_init();
+    if (mem_heap_lo() == NULL)
+	return;
+    mm_set_arenas(arenas != NULL ? atoi(arenas) : (int)sysconf(_SC_NPROCESSORS_ONLN));
+    ready = mm_init() == 0;
+}
+
+/*
+ * start - set up the heap at the first call, and tell if it could be
+ */
+static inline int start(void)
+{
+    if (!__atomic_load_n(&ready, __ATOMIC_ACQUIRE))
+	pthread_once(&init_once, init);
+    return ready;
+}
+
+EXPORT void *malloc(size_t size)
+{
+    void *p;
+
+    if (!start() || (p = mm_malloc(size)) == NULL) {
+	errno = ENOMEM;
+	return NULL;
+    }
+    return p;
+}
+
+EXPORT void free(void *ptr)
+{
+    if (ptr != NULL)
+	mm_free(ptr);
+}
+
+EXPORT void *realloc(void *ptr, size_t size)
+{
+    void *p;
+
+    if (ptr == NULL)
+	return malloc(size);
+    if ((p = mm_realloc(ptr, size)) == NULL && size != 0)
+	errno = ENOMEM;
+    return p;
+}
+
+EXPORT void *reallocarray(void *ptr, size_t nmemb, size_t size)
+{
+    size_t bytes;
+
+    if (__builtin_mul_overflow(nmemb, size, &bytes)) {
+	errno = ENOMEM;
+	return NULL;
+    }
+    return realloc(ptr, bytes);
+}
+
+EXPORT void *calloc(size_t nmemb, size_t size)
+{
+    void *p;
+
+    if (!start() || (p = mm_calloc(nmemb, size)) == NULL) {
+	errno = ENOMEM;
+	return NULL;
+    }
+    return p;
+}
+
+EXPORT int posix_memalign(void **memptr, size_t align, size_t size)
+{
+    void *p;
+
+    if (align % sizeof(void *) != 0 || (align & (align - 1)) != 0 || align == 0)
+	return EINVAL;
+    if (!start() || (p = mm_memalign(align, size)) == NULL)
+	return ENOMEM;
+    *memptr = p;
+    return 0;
+}
+
+EXPORT void *memalign(size_t align, size_t size)
+{
+    void *p;
+
+    if (align == 0 || (align & (align - 1)) != 0) {
+	errno = EINVAL;
+	return NULL;
+    }
+    if (!start() || (p = mm_memalign(align, size)) == NULL) {
+	errno = ENOMEM;
+	return NULL;
+    }
+    return p;
+}
+
+EXPORT void *aligned_alloc(size_t align, size_t size)
+{
+    return memalign(align, size);
+}
+
+EXPORT void *valloc(size_t size)
+{
+    return memalign(getpagesize(), size);
+}
+
+EXPORT void *pvalloc(size_t size)
+{
+    size_t page = getpagesize();
+
+    /* rounding a size near SIZE_MAX up to pages would wrap around to 0 */
+    if (size > SIZE_MAX - page + 1) {
+	errno = ENOMEM;
+	return NULL;
+    }
+    return memalign(page, (size + page - 1) & ~(page - 1));
+}
+
+EXPORT size_t malloc_usable_size(void *ptr)
+{
+    return mm_usable_size(ptr);
+}
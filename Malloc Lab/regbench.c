@@ -0,0 +1,237 @@
+/*
+ * regbench.c - Compares the regions of region.c against allocating and
+ *     freeing every object on its own, on a workload of requests whose
+ *     objects all die when the request is done
+ *
+ * Every request allocates a number of objects, writes to each of them,
+ * and frees all of them at its end: one by one with mm_malloc and
+ * mm_free (or the malloc and free of libc with -l), or by resetting a
+ * region which is kept from one request to the next. The sizes are
+ * drawn before anything is timed. Like mdriver, every package is first
+ * checked for overlapping objects and then timed with fsecs.
+ *
+ * usage: regbench [options]
+ *   -n <reqs>     number of requests (10000)
+ *   -k <objs>     number of objects per request (100)
+ *   -s <min>,<max> sizes of the objects, uniform between min and max (16, 256)
+ *   -b <pct>[,<size>] percentage of the objects which are large, with
+ *                 size bytes, more than a chunk of a region holds (0, 131072)
+ *   -l            run the malloc of libc as well
+ *   -r <seed>     seed of the random numbers (1)
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "mm.h"
+#include "memlib.h"
+#include "region.h"
+#include "fsecs.h"
+
+/* The workload, with the sizes of the objects of every request */
+typedef struct {
+    int requests;          /* number of requests */
+    int objects;           /* objects per request */
+    unsigned *sizes;       /* requests * objects sizes, request after request */
+    char **ptrs;           /* the objects of the current request */
+} work_t;
+
+/* A way of allocating the objects of a request and freeing them */
+typedef struct {
+    char *name;
+    int flags;             /* region_create flags, or -1 for mm, -2 for libc */
+} package_t;
+
+static package_t packages[] = {
+    {"mm", -1},
+    {"region", 0},
+    {"region-mm", REGION_FALLBACK},
+    {"libc", -2},
+};
+#define NUM_PACKAGES (sizeof(packages) / sizeof(packages[0]))
+
+int verbose = 0;               /* read by fsecs */
+static package_t *current;     /* the package run by run_work */
+static int check;              /* check the objects of every request */
+static int failed;             /* an allocation failed or the check did */
+
+static unsigned long long rng = 1;
+
+/*
+ * random_u64 - The next number of a xorshift64* generator
+ */
+static unsigned long long random_u64(void)
+{
+    rng ^= rng >> 12;
+    rng ^= rng << 25;
+    rng ^= rng >> 27;
+    return rng * 2685821657736338717ULL;
+}
+
+/*
+ * check_objects - Fill every object of a request with the low byte of
+ *     its number, then make sure none of them was overwritten by another
+ */
+static void check_objects(work_t *w, unsigned *sizes)
+{
+    int i;
+    unsigned j;
+
+    for (i = 0; i < w->objects; i++)
+	memset(w->ptrs[i], i & 0xFF, sizes[i]);
+    for (i = 0; i < w->objects; i++)
+	for (j = 0; j < sizes[i]; j++)
+	    if ((unsigned char)w->ptrs[i][j] != (i & 0xFF)) {
+		failed = 1;
+		return;
+	    }
+}
+
+/*
+ * run_work - Make all the requests of the workload with the current
+ *     package, on a new heap. This is the function timed by fsecs.
+ */
+static void run_work(void *ptr)
+{
+    work_t *w = (work_t *)ptr;
+    region_t *r = NULL;
+    unsigned *sizes;
+    int i, k;
+
+    mem_reset_brk();
+    if (mm_init() < 0) {
+	failed = 1;
+	return;
+    }
+    region_init();
+    if (current->flags >= 0 && (r = region_create(current->flags)) == NULL) {
+	failed = 1;
+	return;
+    }
+
+    for (i = 0; i < w->requests; i++) {
+	sizes = w->sizes + (size_t)i * w->objects;
+	for (k = 0; k < w->objects; k++) {
+	    if (current->flags >= 0)
+		w->ptrs[k] = region_alloc(r, sizes[k]);
+	    else if (current->flags == -1)
+		w->ptrs[k] = mm_malloc(sizes[k]);
+	    else
+		w->ptrs[k] = malloc(sizes[k]);
+	    if (w->ptrs[k] == NULL) {
+		failed = 1;
+		return;
+	    }
+	    /* the request uses its objects */
+	    w->ptrs[k][0] = k;
+	}
+	if (check)
+	    check_objects(w, sizes);
+
+	/* and they all die with it */
+	if (current->flags >= 0)
+	    region_reset(r);
+	else
+	    for (k = 0; k < w->objects; k++)
+		if (current->flags == -1)
+		    mm_free(w->ptrs[k]);
+		else
+		    free(w->ptrs[k]);
+    }
+    if (r != NULL)
+	region_destroy(r);
+}
+
+static void usage(char *prog)
+{
+    fprintf(stderr, "usage: %s [-n reqs] [-k objs] [-s min,max] [-b pct[,size]] "
+	    "[-l] [-r seed]\n", prog);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    work_t w;
+    unsigned min = 16, max = 256, big = 128 * 1024;
+    double big_pct = 0, secs, total = 0;
+    int run_libc = 0, c;
+    size_t i, n, p;
+
+    w.requests = 10000;
+    w.objects = 100;
+    while ((c = getopt(argc, argv, "n:k:s:b:lr:")) != EOF) {
+	switch (c) {
+	case 'n':
+	    w.requests = atoi(optarg);
+	    break;
+	case 'k':
+	    w.objects = atoi(optarg);
+	    break;
+	case 's':
+	    if (sscanf(optarg, "%u,%u", &min, &max) != 2 || min == 0 || min > max)
+		usage(argv[0]);
+	    break;
+	case 'b':
+	    if (sscanf(optarg, "%lf,%u", &big_pct, &big) < 1 ||
+		big_pct < 0 || big_pct > 100 || big == 0)
+		usage(argv[0]);
+	    break;
+	case 'l':
+	    run_libc = 1;
+	    break;
+	case 'r':
+	    rng = strtoull(optarg, NULL, 10) * 0x9e3779b97f4a7c15ULL | 1;
+	    break;
+	default:
+	    usage(argv[0]);
+	}
+    }
+    if (w.requests < 1 || w.objects < 1)
+	usage(argv[0]);
+
+    /* draw the sizes up front, so that only the packages are timed */
+    n = (size_t)w.requests * w.objects;
+    w.sizes = malloc(n * sizeof(unsigned));
+    w.ptrs = malloc(w.objects * sizeof(char *));
+    if (w.sizes == NULL || w.ptrs == NULL) {
+	fprintf(stderr, "regbench: out of memory for the workload\n");
+	exit(1);
+    }
+    for (i = 0; i < n; i++) {
+	if ((random_u64() >> 11) * (100.0 / (1ULL << 53)) < big_pct)
+	    w.sizes[i] = big;
+	else
+	    w.sizes[i] = min + random_u64() % (max - min + 1);
+	total += w.sizes[i];
+    }
+
+    mem_init();
+    init_fsecs();
+    printf("%d requests of %d objects, %.0f bytes per request\n",
+	   w.requests, w.objects, total / w.requests);
+    printf("%-10s%6s%10s%10s%10s\n", "package", "valid", "secs", "Kobjs", "heapKB");
+    for (p = 0; p < NUM_PACKAGES; p++) {
+	current = &packages[p];
+	if (current->flags == -2 && !run_libc)
+	    continue;
+
+	/* check the package on the workload, then time it */
+	failed = 0;
+	check = 1;
+	run_work(&w);
+	check = 0;
+	if (failed) {
+	    printf("%-10s%6s\n", current->name, "no");
+	    continue;
+	}
+	secs = fsecs(run_work, &w);
+	printf("%-10s%6s%10.6f%10.0f", current->name, "yes", secs, n / secs / 1e3);
+	if (current->flags != -2)
+	    printf("%10lu", (unsigned long)(mem_peak_heapsize() / 1024));
+	printf("\n");
+    }
+    free(w.sizes);
+    free(w.ptrs);
+    return 0;
+}
@@ -0,0 +1,244 @@
+/*
+ * In this file, we implement regions on top of the heap of mm.c, for payloads which all die at the same time,
+ * like those allocated while handling one request.
+ * A region is a list of chunks of at least REGION_CHUNK bytes taken from the heap with mm_sbrk(), and a payload
+ * is handed out by bumping a pointer through the newest chunk, with no overhead and nothing to search.
+ * Nothing is freed on its own: region_reset() frees every payload at once by moving the pointer back
+ * to the start of the first chunk, which also holds the header of the region, and splicing the other chunks
+ * onto a pool shared by all regions, in O(1). A region needing a new chunk takes the first one of the pool,
+ * so that chunks are recycled across resets and regions instead of growing the heap again.
+ *
+ * A payload too large for a chunk gets a chunk of its own, which is as large as it needs, in whole REGION_CHUNKs.
+ * Such large chunks are kept on a list of their own in the region and go back to a pool of their own, which
+ * a large payload searches for the smallest chunk that fits, since the first chunk of a pool of both kinds would
+ * be too small most of the time. Or with REGION_FALLBACK, the payload comes from mm_malloc() and the region keeps
+ * a list of such payloads, which region_reset() frees with mm_free().
+ * The chunks are never given back to mm.c, and mm_init() takes back the whole heap, pool included.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sched.h>
+
+#include "config.h"
+#include "mm.h"
+#include "region.h"
+
+#define ALIGN(size) (((size) + (ALIGNMENT-1)) & ~(size_t)(ALIGNMENT-1))
+
+// the size of the chunks taken from the heap, which are whole chunks of the arenas of mm.c
+#define REGION_CHUNK MM_CHUNK_SIZE
+
+// the header at the start of a chunk, which is followed by the payloads
+typedef struct chunk {
+    struct chunk *next;             // next chunk of the region or of the pool
+    size_t size;                    // size of the chunk, header included
+} chunk_t;
+
+#define CHUNK_HEADER ALIGN(sizeof(chunk_t))
+
+// the header before a payload from mm_malloc(), which links it to the others of its region
+#define BIG_HEADER ALIGN(sizeof(void *))
+
+// the header of a region, which is stored in its first chunk after the header of the chunk
+struct region {
+    char *brk;                      // next free byte of the newest chunk
+    char *end;                      // end of the newest chunk
+    chunk_t *first;                 // the chunk of this header, which region_reset() keeps
+    chunk_t *chunks;                // the other chunks, newest first
+    chunk_t *last;                  // the oldest of them, so that they are put on the pool at once
+    chunk_t *large;                 // the chunks of payloads too large for a chunk, newest first
+    chunk_t *large_last;            // the oldest of them
+    void **big;                     // the newest payload from mm_malloc(), whose header links the older ones
+    int flags;
+};
+
+#define REGION_HEADER ALIGN(sizeof(region_t))
+
+// the chunks no region uses, of REGION_CHUNK bytes and larger, which are changed under pool_lock
+static chunk_t *pool;
+static chunk_t *large_pool;
+static int pool_lock;
+
+
+// take a test-and-set lock like the locks of mm.c
+static void lock(int *l) {
+    while (__atomic_exchange_n(l, 1, __ATOMIC_ACQUIRE))
+        while (__atomic_load_n(l, __ATOMIC_RELAXED))
+            sched_yield();
+}
+
+static void unlock(int *l) {
+    __atomic_store_n(l, 0, __ATOMIC_RELEASE);
+}
+
+/*
+ * region_init - forget the chunks of the previous heap
+ */
+void region_init(void)
+{
+    pool = NULL;
+    large_pool = NULL;
+}
+
+// take a chunk of at least size bytes, header included, which is the first chunk of the pool for a REGION_CHUNK,
+// or the smallest chunk of the large pool which fits for a larger size, and otherwise a new one of whole
+// REGION_CHUNKs from the heap
+// return NULL on failure
+static chunk_t *take_chunk(size_t size) {
+    chunk_t *c, **best = NULL;
+    lock(&pool_lock);
+    if (size <= REGION_CHUNK) {
+        if (pool != NULL)
+            best = &pool;
+    } else {
+        for (chunk_t **p = &large_pool; *p != NULL; p = &(*p)->next)
+            if ((*p)->size >= size && (best == NULL || (*p)->size < (*best)->size))
+                best = p;
+    }
+    if (best != NULL) {
+        c = *best;
+        *best = c->next;
+        unlock(&pool_lock);
+        return c;
+    }
+    unlock(&pool_lock);
+    if (size > MAX_HEAP)
+        return NULL;
+    size = (size + REGION_CHUNK - 1) & ~(size_t)(REGION_CHUNK - 1);
+    if ((c = mm_sbrk(size)) == NULL)
+        return NULL;
+    c->size = size;
+    return c;
+}
+
+// put a list of chunks, from head to tail, on a pool
+static void give_chunks(chunk_t **to, chunk_t *head, chunk_t *tail) {
+    lock(&pool_lock);
+    tail->next = *to;
+    *to = head;
+    unlock(&pool_lock);
+}
+
+// add a chunk to a list of chunks of a region, given by its head and its tail
+static void add_chunk(chunk_t **head, chunk_t **tail, chunk_t *c) {
+    c->next = *head;
+    *head = c;
+    if (*tail == NULL)
+        *tail = c;
+}
+
+// free the payloads of a region which came from mm_malloc()
+static void free_big(region_t *r) {
+    void **p = r->big;
+    while (p != NULL) {
+        void **next = *p;
+        mm_free(p);
+        p = next;
+    }
+    r->big = NULL;
+}
+
+/*
+ * region_create - create an empty region, whose header takes the start of its first chunk
+ * return NULL on failure
+ */
+region_t *region_create(int flags)
+{
+    chunk_t *c = take_chunk(REGION_CHUNK);
+    if (c == NULL)
+        return NULL;
+    region_t *r = (region_t *)(((char *) c) + CHUNK_HEADER);
+    r->first = c;
+    r->brk = ((char *) r) + REGION_HEADER;
+    r->end = ((char *) c) + c->size;
+    r->chunks = NULL;
+    r->last = NULL;
+    r->large = NULL;
+    r->large_last = NULL;
+    r->big = NULL;
+    r->flags = flags;
+    return r;
+}
+
+// allocate a payload which does not fit in the rest of the newest chunk
+// a payload too large for a chunk gets a chunk of its own or comes from mm_malloc(), and the newest chunk stays
+// the newest, otherwise the payload starts a new chunk
+static void *grow(region_t *r, size_t size) {
+    if (size > REGION_CHUNK - CHUNK_HEADER) {
+        // adding a header to a size near SIZE_MAX would wrap around to a size which fits
+        if (size > MAX_HEAP - CHUNK_HEADER)
+            return NULL;
+        if (r->flags & REGION_FALLBACK) {
+            void **p = mm_malloc(BIG_HEADER + size);
+            if (p == NULL)
+                return NULL;
+            *p = r->big;
+            r->big = p;
+            return ((char *) p) + BIG_HEADER;
+        }
+        chunk_t *c = take_chunk(CHUNK_HEADER + size);
+        if (c == NULL)
+            return NULL;
+        add_chunk(&r->large, &r->large_last, c);
+        return ((char *) c) + CHUNK_HEADER;
+    }
+    chunk_t *c = take_chunk(REGION_CHUNK);
+    if (c == NULL)
+        return NULL;
+    add_chunk(&r->chunks, &r->last, c);
+    char *p = ((char *) c) + CHUNK_HEADER;
+    r->brk = p + ALIGN(size);
+    r->end = ((char *) c) + c->size;
+    return p;
+}
+
+/*
+ * region_alloc - allocate a payload of size bytes in a region by bumping its pointer
+ * since the pointer and the end of the chunk are aligned, a payload which fits still fits once it is aligned
+ * return NULL on failure
+ */
+void *region_alloc(region_t *r, size_t size)
+{
+    char *p = r->brk;
+    if (size <= (size_t)(r->end - p)) {
+        r->brk = p + ALIGN(size);
+        return p;
+    }
+    return grow(r, size);
+}
+
+/*
+ * region_reset - free every payload of a region, keeping only its first chunk
+ */
+void region_reset(region_t *r)
+{
+    if (r->big != NULL)
+        free_big(r);
+    if (r->chunks != NULL) {
+        give_chunks(&pool, r->chunks, r->last);
+        r->chunks = NULL;
+        r->last = NULL;
+    }
+    if (r->large != NULL) {
+        give_chunks(&large_pool, r->large, r->large_last);
+        r->large = NULL;
+        r->large_last = NULL;
+    }
+    r->brk = ((char *) r) + REGION_HEADER;
+    r->end = ((char *) r->first) + r->first->size;
+}
+
+/*
+ * region_destroy - free every payload of a region and the region itself
+ */
+void region_destroy(region_t *r)
+{
+    if (r->big != NULL)
+        free_big(r);
+    if (r->large != NULL)
+        give_chunks(&large_pool, r->large, r->large_last);
+    chunk_t *first = r->first;
+    first->next = r->chunks;
+    give_chunks(&pool, first, r->last != NULL ? r->last : first);
+}
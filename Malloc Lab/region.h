@@ -0,0 +1,34 @@
+#include <stdio.h>
+
+/*
+ * A region hands out payloads by bumping a pointer through chunks of
+ * the heap, and frees all of them at once. A region is used by one
+ * thread at a time, while the chunks of all regions are shared.
+ */
+typedef struct region region_t;
+
+/*
+ * Payloads too large for a chunk come from mm_malloc and are freed by
+ * mm_free when the region is reset, instead of being given chunks of
+ * their own which only regions can use again
+ */
+#define REGION_FALLBACK 1
+
+/*
+ * Forgets the chunks of the previous heap, and must be called after
+ * mm_init, which takes back all the memory of the regions
+ */
+extern void region_init(void);
+
+extern region_t *region_create(int flags);
+extern void *region_alloc(region_t *r, size_t size);
+
+/*
+ * Free every payload of a region at once, which keeps its first chunk,
+ * and hand the other chunks over to the regions allocating next.
+ * region_destroy hands over the first chunk as well, so that the region
+ * is gone. Neither looks at the payloads, except for those which came
+ * from mm_malloc.
+ */
+extern void region_reset(region_t *r);
+extern void region_destroy(region_t *r);
@@ -0,0 +1,115 @@
+/*
+ * rep2bin.c - Convert a .rep trace file into the binary trace format
+ *     described in bintrace.h, which mdriver maps instead of parsing
+ *
+ * usage: rep2bin <in.rep> <out>
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bintrace.h"
+
+#define MAXLINE 1024
+
+static void fail(char *msg, char *path)
+{
+    fprintf(stderr, "rep2bin: %s %s\n", msg, path);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    FILE *in, *out;
+    char type[MAXLINE];
+    unsigned char buf[3 * VARINT_MAX];
+    unsigned char *p;
+    int header[4];
+    unsigned index, size, align, count;
+    unsigned long num_ops = 0;
+    int i;
+
+    if (argc != 3) {
+	fprintf(stderr, "usage: %s <in.rep> <out>\n", argv[0]);
+	exit(1);
+    }
+    if ((in = fopen(argv[1], "r")) == NULL)
+	fail("could not open", argv[1]);
+    if ((out = fopen(argv[2], "wb")) == NULL)
+	fail("could not create", argv[2]);
+
+    /* the suggested heap size, the number of ids and requests, and the weight */
+    for (i = 0; i < 4; i++)
+	if (fscanf(in, "%d", &header[i]) != 1 || header[i] < 0)
+	    fail("bad header in", argv[1]);
+    fwrite(BINTRACE_MAGIC, 1, BINTRACE_MAGIC_LEN, out);
+    p = buf;
+    for (i = 0; i < 4; i++)
+	p = put_varint(p, header[i]);
+    fwrite(buf, 1, p - buf, out);
+
+    /* every request line, checked as mdriver would */
+    while (fscanf(in, "%s", type) != EOF) {
+	p = buf;
+	switch (type[0]) {
+	case 'a':
+	case 'r':
+	    if (fscanf(in, "%u %u", &index, &size) != 2)
+		fail("bad request in", argv[1]);
+	    p = put_varint(p, ((unsigned long)index << BT_TYPE_BITS) |
+			   (type[0] == 'a' ? BT_ALLOC : BT_REALLOC));
+	    p = put_varint(p, size);
+	    break;
+	case 'c':
+	    if (fscanf(in, "%u %u", &index, &size) != 2)
+		fail("bad request in", argv[1]);
+	    p = put_varint(p, ((unsigned long)index << BT_TYPE_BITS) | BT_CALLOC);
+	    p = put_varint(p, size);
+	    break;
+	case 'm':
+	    if (fscanf(in, "%u %u %u", &index, &align, &size) != 3 ||
+		align == 0 || (align & (align - 1)) != 0)
+		fail("bad request in", argv[1]);
+	    p = put_varint(p, ((unsigned long)index << BT_TYPE_BITS) | BT_MEMALIGN);
+	    p = put_varint(p, align);
+	    p = put_varint(p, size);
+	    break;
+	case 'f':
+	    if (fscanf(in, "%u", &index) != 1)
+		fail("bad request in", argv[1]);
+	    p = put_varint(p, ((unsigned long)index << BT_TYPE_BITS) | BT_FREE);
+	    break;
+	case 'A':
+	    if (fscanf(in, "%u %u %u", &index, &count, &size) != 3 || count == 0)
+		fail("bad request in", argv[1]);
+	    p = put_varint(p, ((unsigned long)index << BT_TYPE_BITS) | BT_ALLOC_BATCH);
+	    p = put_varint(p, count);
+	    p = put_varint(p, size);
+	    break;
+	case 'F':
+	    if (fscanf(in, "%u %u", &index, &count) != 2 || count == 0)
+		fail("bad request in", argv[1]);
+	    p = put_varint(p, ((unsigned long)index << BT_TYPE_BITS) | BT_FREE_BATCH);
+	    p = put_varint(p, count);
+	    break;
+	default:
+	    fprintf(stderr, "rep2bin: bogus type character (%c) in %s\n",
+		    type[0], argv[1]);
+	    exit(1);
+	}
+	/* a batch takes the ids from index to index + count - 1 */
+	if (type[0] != 'A' && type[0] != 'F')
+	    count = 1;
+	if ((unsigned long)index + count > (unsigned long)header[1])
+	    fail("index out of range in", argv[1]);
+	fwrite(buf, 1, p - buf, out);
+	num_ops++;
+    }
+    if (num_ops != (unsigned long)header[2])
+	fail("wrong number of requests in", argv[1]);
+
+    fclose(in);
+    if (fclose(out) != 0)
+	fail("could not write", argv[2]);
+    return 0;
+}
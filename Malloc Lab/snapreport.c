@@ -0,0 +1,405 @@
+/*
+ * snapreport.c - Turns a snapshot of the heap of mm.c, written by
+ *     mm_dump_snapshot (see heapsnap.h and mdriver -d), into a map of
+ *     the fragmentation of the heap and a report of the bytes wasted
+ *     in each size class and in each phase of the trace
+ *
+ * The map prints a character per cell of the heap, from ' ' when the
+ * blocks in the cell are all allocated to '@' when they are all free,
+ * with 'o' for a cell of slab pages and '_' for the bytes of the heap
+ * outside the blocks, like the arenas or the chunks of regions.
+ *
+ * The free bytes of each size class are known exactly from the blocks.
+ * The bytes requested and the bytes of their blocks are estimated from
+ * the sampled payloads: a payload of s bytes holding h sampled bytes
+ * stands for h * period / s payloads like it. The difference, the
+ * bytes of the blocks beyond what was requested, is the waste of the
+ * class. The phases split the requests up to the snapshot in equal
+ * parts, so that they show which part of the trace the live payloads
+ * come from, by the index of the request which allocated them.
+ *
+ * usage: snapreport [options] <snapshot>
+ *   -w <cols>     cells per line of the map (64)
+ *   -c <bytes>    bytes per cell of the map, rounded to 16 (enough
+ *                 for the map to take at most 32 lines)
+ *   -n <phases>   number of phases of the trace (10)
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "heapsnap.h"
+#include "mm.h"
+
+#define MAX_PHASES 100
+#define MAX_LINES 32
+
+/* What the samples tell about a set of payloads: estimates of their
+   number, of the bytes requested and of the bytes of their blocks */
+typedef struct {
+    unsigned long samples;
+    double payloads;
+    double requested;
+    double block_bytes;
+} usage_t;
+
+/* The size classes of free blocks of mm.h, the k-th of which holds
+   2^(k+4) up to 2^(k+5)-1 bytes, and the last one all larger sizes */
+typedef struct {
+    usage_t use;                /* payloads requested in the class */
+    unsigned long free_blocks;  /* free blocks of the class */
+    unsigned long free_bytes;
+} class_t;
+
+/* The snapshot, decoded in one pass */
+typedef struct {
+    unsigned long heap;         /* bytes from the start of the heap to the brk */
+    unsigned long period;       /* sample period */
+    unsigned long site;         /* the request the snapshot was taken after */
+    unsigned long arenas;
+    unsigned long segments;
+    unsigned long alloc_bytes, alloc_blocks;
+    unsigned long free_bytes, free_blocks, largest_free;
+    unsigned long slab_pages, slab_bytes, slab_slot_bytes, slab_used_bytes;
+    unsigned long mapped_bytes, mapped_blocks;
+    double *free_cells;         /* free bytes in each cell of the map */
+    double *block_cells;        /* bytes of blocks in each cell */
+    double *slab_cells;         /* bytes of slab pages in each cell */
+    unsigned long cell;         /* bytes per cell */
+    unsigned long cells;
+    class_t classes[MM_FREE_CLASSES];
+    usage_t phases[MAX_PHASES];
+    int nphases;
+} snapshot_t;
+
+static const unsigned char *end;    /* end of the bytes of the snapshot */
+
+/*
+ * fail - Print a message and exit
+ */
+static void fail(char *msg)
+{
+    fprintf(stderr, "snapreport: %s\n", msg);
+    exit(1);
+}
+
+/*
+ * next - Read the next varint of the snapshot
+ */
+static unsigned long next(const unsigned char **p)
+{
+    unsigned long v;
+
+    if (*p >= end)
+	fail("truncated snapshot");
+    *p = get_varint(*p, &v);
+    if (*p > end)
+	fail("truncated snapshot");
+    return v;
+}
+
+/*
+ * size_class - The size class of mm.h of a size in bytes
+ */
+static int size_class(unsigned long size)
+{
+    int k = 0;
+
+    while (k < MM_FREE_CLASSES - 1 && size >= (32UL << k))
+	k++;
+    return k;
+}
+
+/*
+ * add_cells - Add the bytes from lo to hi of the heap to the cells of
+ *     the map they fall in
+ */
+static void add_cells(snapshot_t *s, double *cells, unsigned long lo,
+		      unsigned long hi)
+{
+    unsigned long c, start, stop;
+
+    for (c = lo / s->cell; c < s->cells && c * s->cell < hi; c++) {
+	start = c * s->cell > lo ? c * s->cell : lo;
+	stop = (c + 1) * s->cell < hi ? (c + 1) * s->cell : hi;
+	cells[c] += stop - start;
+    }
+}
+
+/*
+ * add_usage - Add a sampled payload to the estimates of a set of payloads
+ */
+static void add_usage(usage_t *u, unsigned long block, unsigned long size,
+		      unsigned long hits, unsigned long period)
+{
+    double n = (double)hits * period / size;
+
+    u->samples++;
+    u->payloads += n;
+    u->requested += n * size;
+    u->block_bytes += n * block;
+}
+
+/*
+ * read_segment - Read the blocks of a segment whose first block is at
+ *     offset off
+ */
+static const unsigned char *read_segment(snapshot_t *s, const unsigned char *p,
+					 unsigned long off)
+{
+    unsigned long v, size, slot, slots, used;
+
+    s->segments++;
+    while ((v = next(&p)) != 0) {
+	size = v & ~(unsigned long)SNAP_KIND_MASK;
+	add_cells(s, s->block_cells, off, off + size);
+	switch (v & SNAP_KIND_MASK) {
+	case SNAP_FREE:
+	    s->free_bytes += size;
+	    s->free_blocks++;
+	    if (size > s->largest_free)
+		s->largest_free = size;
+	    s->classes[size_class(size)].free_bytes += size;
+	    s->classes[size_class(size)].free_blocks++;
+	    add_cells(s, s->free_cells, off, off + size);
+	    break;
+	case SNAP_SLAB:
+	    slot = next(&p);
+	    slots = next(&p);
+	    used = next(&p);
+	    s->slab_pages++;
+	    s->slab_bytes += size;
+	    s->slab_slot_bytes += slot * slots;
+	    s->slab_used_bytes += slot * used;
+	    add_cells(s, s->slab_cells, off, off + size);
+	    break;
+	case SNAP_ALLOC:
+	    s->alloc_bytes += size;
+	    s->alloc_blocks++;
+	    break;
+	default:
+	    fail("bad kind of block");
+	}
+	off += size;
+    }
+    return p;
+}
+
+/*
+ * read_snapshot - Decode a snapshot of len bytes at p
+ */
+static void read_snapshot(snapshot_t *s, const unsigned char *p, size_t len,
+			  unsigned long width, unsigned long cell)
+{
+    unsigned long tag, off, block, size, site, hits;
+    int phase;
+
+    end = p + len;
+    if (len < HEAPSNAP_MAGIC_LEN || memcmp(p, HEAPSNAP_MAGIC, HEAPSNAP_MAGIC_LEN) != 0)
+	fail("not a heap snapshot");
+    p += HEAPSNAP_MAGIC_LEN;
+    s->heap = next(&p);
+    s->period = next(&p);
+    s->site = next(&p);
+    s->arenas = next(&p);
+
+    /* cells of whole 16-byte units, as few as fit in MAX_LINES lines */
+    if (cell == 0)
+	cell = (s->heap + width * MAX_LINES - 1) / (width * MAX_LINES);
+    s->cell = (cell + 15) & ~15UL;
+    if (s->cell == 0)
+	s->cell = 16;
+    s->cells = (s->heap + s->cell - 1) / s->cell;
+    s->free_cells = calloc(s->cells + 1, sizeof(double));
+    s->block_cells = calloc(s->cells + 1, sizeof(double));
+    s->slab_cells = calloc(s->cells + 1, sizeof(double));
+    if (s->free_cells == NULL || s->block_cells == NULL || s->slab_cells == NULL)
+	fail("out of memory for the map");
+
+    while ((tag = next(&p)) != SNAP_END) {
+	switch (tag) {
+	case SNAP_SEGMENT:
+	    off = next(&p);
+	    p = read_segment(s, p, off);
+	    break;
+	case SNAP_MAPPED:
+	    s->mapped_bytes += next(&p);
+	    s->mapped_blocks++;
+	    break;
+	case SNAP_SAMPLE:
+	    next(&p);
+	    block = next(&p);
+	    size = next(&p);
+	    site = next(&p);
+	    hits = next(&p);
+	    if (size == 0 || s->period == 0)
+		fail("bad sample");
+	    add_usage(&s->classes[size_class(size)].use, block, size, hits, s->period);
+	    phase = site > s->site ? s->nphases - 1 : (int)(site * s->nphases / (s->site + 1));
+	    add_usage(&s->phases[phase], block, size, hits, s->period);
+	    break;
+	default:
+	    fail("bad record");
+	}
+    }
+}
+
+/*
+ * print_map - Plot the free bytes of every cell of the heap
+ */
+static void print_map(snapshot_t *s, unsigned long width)
+{
+    static char levels[] = " .:-=+*#%@";
+    int nlevels = sizeof(levels) - 1;
+    unsigned long c;
+    double f;
+
+    printf("Fragmentation map, %lu bytes per cell (' ' all allocated, '@' all free, "
+	   "'o' slab pages, '_' no blocks):\n", s->cell);
+    for (c = 0; c < s->cells; c++) {
+	if (c % width == 0)
+	    printf("%10lu |", c * s->cell);
+	if (s->block_cells[c] == 0)
+	    putchar('_');
+	else if (s->slab_cells[c] * 2 > s->block_cells[c])
+	    putchar('o');
+	else {
+	    f = s->free_cells[c] / s->block_cells[c];
+	    /* a cell with any free byte is never blank */
+	    putchar(levels[f > 0 && f * (nlevels - 1) < 1 ? 1 : (int)(f * (nlevels - 1) + 0.5)]);
+	}
+	if (c % width == width - 1 || c == s->cells - 1)
+	    printf("%*s|\n", (int)(width - 1 - c % width), "");
+    }
+}
+
+/*
+ * print_usage - Print a row of estimates for a set of payloads
+ */
+static void print_usage(usage_t *u)
+{
+    double waste = u->block_bytes - u->requested;
+
+    printf("%8lu%10.0f%10.1f%10.1f%10.1f%7.1f%%",
+	   u->samples, u->payloads, u->requested / 1024, u->block_bytes / 1024,
+	   waste / 1024, u->block_bytes > 0 ? 100 * waste / u->block_bytes : 0.0);
+}
+
+/*
+ * print_report - Print the totals, then the waste by size class and by phase
+ */
+static void print_report(snapshot_t *s)
+{
+    usage_t total;
+    unsigned long lo, hi, free_blocks = 0, free_bytes = 0;
+    int k;
+
+    printf("heap %lu bytes, %lu arenas, %lu segments, after request %lu\n",
+	   s->heap, s->arenas, s->segments, s->site);
+    printf("allocated %lu bytes in %lu blocks, free %lu bytes (%.1f%% of the heap) "
+	   "in %lu blocks, largest %lu\n",
+	   s->alloc_bytes, s->alloc_blocks, s->free_bytes,
+	   s->heap ? 100.0 * s->free_bytes / s->heap : 0.0, s->free_blocks, s->largest_free);
+    printf("slab pages %lu (%lu bytes), %lu of %lu slot bytes in use\n",
+	   s->slab_pages, s->slab_bytes, s->slab_used_bytes, s->slab_slot_bytes);
+    printf("mapped %lu bytes in %lu blocks\n", s->mapped_bytes, s->mapped_blocks);
+    if (s->period == 0)
+	printf("no samples: the profiler was off\n");
+    printf("\n");
+
+    printf("Waste by size class of the request (estimated from samples every %lu bytes):\n",
+	   s->period);
+    printf("%-14s%8s%10s%10s%10s%10s%8s%10s%10s\n", "class", "samples", "payloads",
+	   "reqKB", "blockKB", "wasteKB", "waste", "freeKB", "freeblks");
+    memset(&total, 0, sizeof(total));
+    for (k = 0; k < MM_FREE_CLASSES; k++) {
+	class_t *c = &s->classes[k];
+	if (c->use.samples == 0 && c->free_blocks == 0)
+	    continue;
+	lo = k == 0 ? 0 : 16UL << k;
+	hi = (32UL << k) - 1;
+	if (k == MM_FREE_CLASSES - 1)
+	    printf("%7lu%-7s", lo, "-");
+	else
+	    printf("%7lu-%-6lu", lo, hi);
+	print_usage(&c->use);
+	printf("%10.1f%10lu\n", c->free_bytes / 1024.0, c->free_blocks);
+	total.samples += c->use.samples;
+	total.payloads += c->use.payloads;
+	total.requested += c->use.requested;
+	total.block_bytes += c->use.block_bytes;
+	free_bytes += c->free_bytes;
+	free_blocks += c->free_blocks;
+    }
+    printf("%-14s", "total");
+    print_usage(&total);
+    printf("%10.1f%10lu\n\n", free_bytes / 1024.0, free_blocks);
+
+    printf("Waste by phase of the trace, by the request which allocated the payload:\n");
+    printf("%-14s%8s%10s%10s%10s%10s%8s\n", "requests", "samples", "payloads",
+	   "reqKB", "blockKB", "wasteKB", "waste");
+    for (k = 0; k < s->nphases; k++) {
+	lo = (unsigned long)((double)(s->site + 1) * k / s->nphases);
+	hi = (unsigned long)((double)(s->site + 1) * (k + 1) / s->nphases);
+	if (lo == hi)
+	    continue;
+	printf("%6lu-%-7lu", lo, hi - 1);
+	print_usage(&s->phases[k]);
+	printf("\n");
+    }
+}
+
+static void usage(char *prog)
+{
+    fprintf(stderr, "usage: %s [-w cols] [-c bytes] [-n phases] <snapshot>\n", prog);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    snapshot_t s;
+    unsigned long width = 64, cell = 0;
+    unsigned char *buf;
+    size_t len = 0, cap = 1 << 16, n;
+    FILE *f;
+    int c;
+
+    memset(&s, 0, sizeof(s));
+    s.nphases = 10;
+    while ((c = getopt(argc, argv, "w:c:n:")) != EOF) {
+	switch (c) {
+	case 'w':
+	    width = strtoul(optarg, NULL, 10);
+	    break;
+	case 'c':
+	    cell = strtoul(optarg, NULL, 10);
+	    break;
+	case 'n':
+	    s.nphases = atoi(optarg);
+	    break;
+	default:
+	    usage(argv[0]);
+	}
+    }
+    if (optind != argc - 1 || width == 0 || s.nphases < 1 || s.nphases > MAX_PHASES)
+	usage(argv[0]);
+
+    if ((f = fopen(argv[optind], "rb")) == NULL)
+	fail("could not open the snapshot");
+    if ((buf = malloc(cap)) == NULL)
+	fail("out of memory for the snapshot");
+    while ((n = fread(buf + len, 1, cap - len, f)) > 0) {
+	len += n;
+	if (len == cap && (buf = realloc(buf, cap *= 2)) == NULL)
+	    fail("out of memory for the snapshot");
+    }
+    fclose(f);
+
+    read_snapshot(&s, buf, len, width, cell);
+    print_report(&s);
+    printf("\n");
+    print_map(&s, width);
+    free(buf);
+    return 0;
+}
@@ -0,0 +1,439 @@
+/*
+ * tracegen.c - Generate synthetic traces for mdriver, as .rep files or
+ *     in the binary format of bintrace.h
+ *
+ * The sizes of the blocks are drawn from a distribution, and every block
+ * is given a lifetime, counted in requests, when it is allocated. A block
+ * is freed once its lifetime has passed, or earlier if the live payloads
+ * would otherwise grow beyond the live-set target, in which case the block
+ * which would die first goes first. Some requests reallocate a live block
+ * to a multiple of its size instead, like a growing buffer, and some blocks
+ * can be allocated by calloc or memalign instead of malloc. Some requests
+ * can allocate a batch of blocks of the same size at once, which live
+ * and are freed together, like the nodes of a request being handled.
+ *
+ * usage: tracegen [options] <out>
+ *   -n <ops>      number of requests before the blocks left are freed (100000)
+ *   -d <dist>     distribution of the sizes (lognormal:4.5,0.8), one of
+ *                   lognormal:<mu>,<sigma>   exp of a normal variable
+ *                   power:<alpha>,<min>,<max> power law between min and max
+ *                   hist:<file>              lines "<size> <weight>"
+ *   -t <mean>[,<skew>]  mean lifetime in requests (1000), which is scaled
+ *                 by (size / 64)^skew, so that a positive skew keeps
+ *                 large blocks longer than small ones (0)
+ *   -r <pct>[,<factor>] percentage of the requests which reallocate a live
+ *                 block to factor times its size (0, 2)
+ *   -c <pct>      percentage of the blocks allocated by calloc (0)
+ *   -a <pct>[,<align>] percentage of the blocks allocated by memalign, each
+ *                 with a power of two from 32 up to align (0, 4096)
+ *   -B <pct>[,<n>] percentage of the allocations which are batches of n
+ *                 blocks, allocated by one request and freed by one (0, 16)
+ *   -L <bytes>    live-set target, the most payload bytes live at once,
+ *                 with an optional suffix k, m or g (no target)
+ *   -m <bytes>    largest size of a block (1m)
+ *   -s <seed>     seed of the random numbers (1)
+ *   -b            write a binary trace instead of a .rep file
+ *
+ * The requests are written to a temporary file first, since the header
+ * of a trace holds the number of ids and requests, which are only known
+ * at the end, so that traces of millions of requests are never in memory.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+
+#include "bintrace.h"
+
+#define MAXLINE 1024
+#define LIFETIME_SIZE 64   /* the size whose lifetime is not scaled by the skew */
+
+/* A live block or batch, kept in a heap ordered by the request it dies at */
+typedef struct {
+    unsigned long death;  /* request after which the block is freed */
+    unsigned index;       /* id of the block, or of the first block of a batch */
+    unsigned size;        /* payload size */
+    unsigned count;       /* number of blocks, which is 1 unless it is a batch */
+} block_t;
+
+/* The distribution of the sizes */
+enum { LOGNORMAL, POWER, HIST };
+static int dist = LOGNORMAL;
+static double mu = 4.5, sigma = 0.8;          /* lognormal */
+static double alpha, pmin, pmax;              /* power law */
+static unsigned *hist_sizes;                  /* histogram, with the */
+static double *hist_cum;                      /* cumulative weights */
+static int hist_len;
+
+static unsigned long max_size = 1 << 20;
+static unsigned long long rng = 1;
+
+static block_t *live;         /* heap of the live blocks */
+static unsigned long num_live, max_live;
+
+static FILE *ops;             /* temporary file of the requests */
+static int binary = 0;
+static unsigned long num_ops = 0;
+
+static void fail(char *msg, char *arg)
+{
+    fprintf(stderr, "tracegen: %s %s\n", msg, arg);
+    exit(1);
+}
+
+/*
+ * random_u64 - The next number of a xorshift64* generator
+ */
+static unsigned long long random_u64(void)
+{
+    rng ^= rng >> 12;
+    rng ^= rng << 25;
+    rng ^= rng >> 27;
+    return rng * 2685821657736338717ULL;
+}
+
+/*
+ * random_unit - A uniform number in (0, 1)
+ */
+static double random_unit(void)
+{
+    return ((random_u64() >> 11) + 0.5) / (double)(1ULL << 53);
+}
+
+/*
+ * random_size - Draw a size from the distribution, between 1 and max_size
+ */
+static unsigned random_size(void)
+{
+    double x, u = random_unit();
+    int lo, hi, mid;
+
+    switch (dist) {
+    case LOGNORMAL: /* Box-Muller gives the normal variable */
+	x = exp(mu + sigma * sqrt(-2 * log(u)) * cos(2 * M_PI * random_unit()));
+	break;
+    case POWER: /* inverse of the distribution function of a bounded Pareto */
+	x = pmin / pow(1 - u * (1 - pow(pmin / pmax, alpha)), 1 / alpha);
+	break;
+    default: /* the first bucket whose cumulative weight reaches u */
+	u *= hist_cum[hist_len - 1];
+	for (lo = 0, hi = hist_len - 1; lo < hi; ) {
+	    mid = (lo + hi) / 2;
+	    if (hist_cum[mid] < u)
+		lo = mid + 1;
+	    else
+		hi = mid;
+	}
+	x = hist_sizes[lo];
+    }
+    if (x < 1)
+	return 1;
+    return (x > max_size) ? max_size : (unsigned)x;
+}
+
+/*
+ * read_hist - Read the "<size> <weight>" lines of an empirical histogram
+ */
+static void read_hist(char *path)
+{
+    FILE *fp;
+    unsigned size;
+    double weight, total = 0;
+    int cap = 0;
+
+    if ((fp = fopen(path, "r")) == NULL)
+	fail("could not open", path);
+    while (fscanf(fp, "%u %lf", &size, &weight) == 2) {
+	if (weight < 0)
+	    fail("negative weight in", path);
+	if (hist_len == cap) {
+	    cap = cap ? 2 * cap : 64;
+	    hist_sizes = realloc(hist_sizes, cap * sizeof(unsigned));
+	    hist_cum = realloc(hist_cum, cap * sizeof(double));
+	    if (hist_sizes == NULL || hist_cum == NULL)
+		fail("out of memory reading", path);
+	}
+	total += weight;
+	hist_sizes[hist_len] = size;
+	hist_cum[hist_len++] = total;
+    }
+    if (!feof(fp) || hist_len == 0 || total == 0)
+	fail("bad histogram in", path);
+    fclose(fp);
+}
+
+/*
+ * parse_dist - Parse the argument of -d
+ */
+static void parse_dist(char *arg)
+{
+    if (sscanf(arg, "lognormal:%lf,%lf", &mu, &sigma) == 2 && sigma >= 0)
+	dist = LOGNORMAL;
+    else if (sscanf(arg, "power:%lf,%lf,%lf", &alpha, &pmin, &pmax) == 3 &&
+	     alpha > 0 && pmin >= 1 && pmax > pmin)
+	dist = POWER;
+    else if (!strncmp(arg, "hist:", 5)) {
+	dist = HIST;
+	read_hist(arg + 5);
+    }
+    else
+	fail("bad distribution", arg);
+}
+
+/*
+ * parse_bytes - Parse a number of bytes with an optional suffix k, m or g
+ */
+static unsigned long parse_bytes(char *arg)
+{
+    char *end;
+    unsigned long v = strtoul(arg, &end, 10);
+
+    switch (*end) {
+    case 'k': case 'K': v <<= 10; end++; break;
+    case 'm': case 'M': v <<= 20; end++; break;
+    case 'g': case 'G': v <<= 30; end++; break;
+    }
+    if (*end != '\0' || v == 0)
+	fail("bad number of bytes", arg);
+    return v;
+}
+
+/*
+ * put_op - Write a request to the temporary file, where arg is the 
+ *     alignment of a memalign or the number of blocks of a batch
+ */
+static void put_op(int type, unsigned index, unsigned size, unsigned arg)
+{
+    static const char letters[] = {'a', 'f', 'r', 'c', 'm', 'A', 'F'};
+    unsigned char buf[3 * VARINT_MAX];
+    unsigned char *p = buf;
+
+    if (binary) {
+	p = put_varint(p, ((unsigned long)index << BT_TYPE_BITS) | type);
+	if (type == BT_MEMALIGN || type == BT_ALLOC_BATCH || type == BT_FREE_BATCH)
+	    p = put_varint(p, arg);
+	if (type != BT_FREE && type != BT_FREE_BATCH)
+	    p = put_varint(p, size);
+	fwrite(buf, 1, p - buf, ops);
+    }
+    else if (type == BT_FREE)
+	fprintf(ops, "f %u\n", index);
+    else if (type == BT_FREE_BATCH)
+	fprintf(ops, "F %u %u\n", index, arg);
+    else if (type == BT_MEMALIGN || type == BT_ALLOC_BATCH)
+	fprintf(ops, "%c %u %u %u\n", letters[type], index, arg, size);
+    else
+	fprintf(ops, "%c %u %u\n", letters[type], index, size);
+    num_ops++;
+}
+
+/*
+ * sift_down - Restore the order of the heap below the block at i
+ */
+static void sift_down(unsigned long i)
+{
+    block_t b = live[i];
+    unsigned long c;
+
+    while ((c = 2 * i + 1) < num_live) {
+	if (c + 1 < num_live && live[c + 1].death < live[c].death)
+	    c++;
+	if (b.death <= live[c].death)
+	    break;
+	live[i] = live[c];
+	i = c;
+    }
+    live[i] = b;
+}
+
+/*
+ * push_block - Add a block, or a batch of count blocks, to the heap of 
+ *     the live blocks
+ */
+static void push_block(unsigned long death, unsigned index, unsigned size,
+		       unsigned count)
+{
+    unsigned long i = num_live++;
+
+    if (num_live > max_live) {
+	max_live = max_live ? 2 * max_live : 1024;
+	if ((live = realloc(live, max_live * sizeof(block_t))) == NULL)
+	    fail("out of memory for", "the live blocks");
+    }
+    for (; i > 0 && live[(i - 1) / 2].death > death; i = (i - 1) / 2)
+	live[i] = live[(i - 1) / 2];
+    live[i].death = death;
+    live[i].index = index;
+    live[i].size = size;
+    live[i].count = count;
+}
+
+/*
+ * pop_block - Free the block or batch which dies first and return its 
+ *     payload bytes
+ */
+static unsigned long pop_block(void)
+{
+    unsigned long size = (unsigned long)live[0].size * live[0].count;
+
+    if (live[0].count > 1)
+	put_op(BT_FREE_BATCH, live[0].index, 0, live[0].count);
+    else
+	put_op(BT_FREE, live[0].index, 0, 0);
+    live[0] = live[--num_live];
+    sift_down(0);
+    return size;
+}
+
+int main(int argc, char **argv)
+{
+    FILE *out;
+    unsigned char buf[MAXLINE];
+    unsigned char *p;
+    unsigned long header[4];
+    unsigned long requests = 100000, target = 0, i, t, n;
+    unsigned long live_bytes = 0, peak_bytes = 0;
+    unsigned num_ids = 0, size, newsize, align, max_align = 4096, batch = 16;
+    double mean = 1000, skew = 0, realloc_pct = 0, factor = 2, lifetime;
+    double calloc_pct = 0, memalign_pct = 0, batch_pct = 0, u;
+    int c, type;
+
+    while ((c = getopt(argc, argv, "n:d:t:r:c:a:B:L:m:s:b")) != EOF) {
+	switch (c) {
+	case 'n':
+	    requests = strtoul(optarg, NULL, 10);
+	    break;
+	case 'd':
+	    parse_dist(optarg);
+	    break;
+	case 't':
+	    if (sscanf(optarg, "%lf,%lf", &mean, &skew) < 1 || mean < 1)
+		fail("bad lifetime", optarg);
+	    break;
+	case 'r':
+	    if (sscanf(optarg, "%lf,%lf", &realloc_pct, &factor) < 1 ||
+		realloc_pct < 0 || realloc_pct > 100 || factor <= 0)
+		fail("bad realloc pattern", optarg);
+	    break;
+	case 'c':
+	    calloc_pct = strtod(optarg, NULL);
+	    if (calloc_pct < 0 || calloc_pct > 100)
+		fail("bad calloc percentage", optarg);
+	    break;
+	case 'a':
+	    if (sscanf(optarg, "%lf,%u", &memalign_pct, &max_align) < 1 ||
+		memalign_pct < 0 || memalign_pct > 100 ||
+		max_align < 32 || (max_align & (max_align - 1)) != 0)
+		fail("bad memalign pattern", optarg);
+	    break;
+	case 'B':
+	    if (sscanf(optarg, "%lf,%u", &batch_pct, &batch) < 1 ||
+		batch_pct < 0 || batch_pct > 100 || batch < 2)
+		fail("bad batch pattern", optarg);
+	    break;
+	case 'L':
+	    target = parse_bytes(optarg);
+	    break;
+	case 'm':
+	    max_size = parse_bytes(optarg);
+	    if (max_size > 0x7fffffff)
+		fail("sizes must fit in an int, not", optarg);
+	    break;
+	case 's':
+	    rng = strtoull(optarg, NULL, 10) * 0x9e3779b97f4a7c15ULL | 1;
+	    break;
+	case 'b':
+	    binary = 1;
+	    break;
+	default:
+	    fprintf(stderr, "usage: %s [-n ops] [-d dist] [-t mean[,skew]] "
+		    "[-r pct[,factor]] [-c pct] [-a pct[,align]] [-B pct[,n]] [-L bytes] [-m bytes] "
+		    "[-s seed] [-b] <out>\n",
+		    argv[0]);
+	    exit(1);
+	}
+    }
+    if (optind != argc - 1)
+	fail("expects one output file, see the top of", "tracegen.c");
+    if ((ops = tmpfile()) == NULL)
+	fail("could not create a temporary file for", argv[optind]);
+
+    for (t = 0; t < requests; t++) {
+	/* free the blocks whose time has come */
+	while (num_live > 0 && live[0].death <= t && num_ops < requests)
+	    live_bytes -= pop_block();
+	if (num_ops >= requests)
+	    break;
+
+	/* grow a random live block, unless it is a batch */
+	if (num_live > 0 && random_unit() * 100 < realloc_pct &&
+	    live[i = random_u64() % num_live].count == 1) {
+	    size = live[i].size;
+	    newsize = (size * factor > max_size) ? max_size : (unsigned)(size * factor);
+	    if (newsize == 0)
+		newsize = 1;
+	    put_op(BT_REALLOC, live[i].index, newsize, 0);
+	    live[i].size = newsize;
+	    live_bytes += newsize - size;
+	}
+	else {
+	    /* allocate a block with its lifetime */
+	    size = random_size();
+	    lifetime = -mean * log(random_unit()) *
+		(skew ? pow((double)size / LIFETIME_SIZE, skew) : 1);
+	    u = random_unit() * 100;
+	    if (u < batch_pct) {
+		put_op(BT_ALLOC_BATCH, num_ids, size, batch);
+		push_block(t + 1 + (unsigned long)lifetime, num_ids, size, batch);
+		num_ids += batch;
+		live_bytes += (unsigned long)size * batch;
+	    }
+	    else {
+		u -= batch_pct;
+		type = (u < calloc_pct) ? BT_CALLOC :
+		    (u < calloc_pct + memalign_pct) ? BT_MEMALIGN : BT_ALLOC;
+		align = (type == BT_MEMALIGN) ?
+		    32u << (random_u64() % (31 - __builtin_clz(max_align) - 4)) : 0;
+		put_op(type, num_ids, size, align);
+		push_block(t + 1 + (unsigned long)lifetime, num_ids++, size, 1);
+		live_bytes += size;
+	    }
+	}
+
+	/* make room for the live-set target */
+	while (target && live_bytes > target && num_live > 1 && num_ops < requests)
+	    live_bytes -= pop_block();
+	if (live_bytes > peak_bytes)
+	    peak_bytes = live_bytes;
+    }
+
+    /* free what is left, so the trace ends with an empty heap */
+    for (n = num_live; n > 0; n--)
+	pop_block();
+
+    if ((out = fopen(argv[optind], binary ? "wb" : "w")) == NULL)
+	fail("could not create", argv[optind]);
+    /* mdriver reads the header as ints */
+    header[0] = (peak_bytes > 0x7fffffff) ? 0x7fffffff : peak_bytes;
+    header[1] = num_ids;
+    header[2] = num_ops;
+    header[3] = 1;
+    if (binary) {
+	fwrite(BINTRACE_MAGIC, 1, BINTRACE_MAGIC_LEN, out);
+	for (p = buf, i = 0; i < 4; i++)
+	    p = put_varint(p, header[i]);
+	fwrite(buf, 1, p - buf, out);
+    }
+    else
+	fprintf(out, "%lu\n%lu\n%lu\n%lu\n", header[0], header[1], header[2], header[3]);
+
+    /* copy the requests after the header */
+    rewind(ops);
+    while ((n = fread(buf, 1, sizeof(buf), ops)) > 0)
+	fwrite(buf, 1, n, out);
+    fclose(ops);
+    if (fclose(out) != 0)
+	fail("could not write", argv[optind]);
+    return 0;
+}